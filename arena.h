@@ -0,0 +1,73 @@
+//Fixed-capacity storage, used instead of std::vector
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace freilite{
+namespace iris{
+    //index_for<MAXIMUM>::type is the smallest unsigned type that can hold all values up to MAXIMUM
+    template<bool condition, typename if_true, typename if_false>
+    struct select_type{ typedef if_true type; };
+    template<typename if_true, typename if_false>
+    struct select_type<false, if_true, if_false>{ typedef if_false type; };
+
+    template<uint32_t MAXIMUM>
+    struct index_for{
+        static_assert(MAXIMUM <= 0xFFFF, "Indices are at most 16 bits wide");
+        typedef typename select_type<MAXIMUM <= 0xFF, uint8_t, uint16_t>::type type;
+    };
+
+    //Holds up to CAPACITY elements of type T. All memory is reserved statically:
+    //nothing is allocated at runtime, so the heap can't fragment and RAM usage
+    //is known at compile time. T needs to be default-constructible
+    template<typename T, uint16_t CAPACITY>
+    class arena_t{
+        public:
+            typedef typename index_for<CAPACITY>::type size_type;
+
+        private:
+            T elements[CAPACITY];
+            size_type used;
+
+        public:
+            arena_t() : used(0){}
+
+            //Append element. Returns false if the arena is full
+            bool push_back(const T& element){
+                if(used >= CAPACITY) return false;
+                elements[used++] = element;
+                return true;
+            }
+
+            //Remove all elements, their memory stays reserved
+            void clear(){
+                used = 0;
+            }
+
+            size_type size() const{ return used; }
+            static size_type capacity(){ return CAPACITY; }
+            bool empty() const{ return used == 0; }
+            bool full() const{ return used >= CAPACITY; }
+
+            T& operator[](size_type index){ return elements[index]; }
+            const T& operator[](size_type index) const{ return elements[index]; }
+            T& back(){ return elements[used - 1]; }
+
+            T* begin(){ return elements; }
+            T* end(){ return elements + used; }
+            const T* begin() const{ return elements; }
+            const T* end() const{ return elements + used; }
+
+            //Bytes taken up by elements
+            size_t size_in_bytes() const{
+                return used * sizeof(T);
+            }
+
+            //Bytes reserved, but not taken up by elements, including unused capacity
+            size_t memory_overhead() const{
+                return sizeof(*this) - size_in_bytes();
+            }
+    };
+}
+}
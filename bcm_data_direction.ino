@@ -4,10 +4,40 @@
 #include "led_ring.h"
 #include "storage.h"
 #include "communication.h"
+#include "frame_scheduler.h"
+#include "calibrator.h"
+
+using namespace freilite::iris;
+
+//SRAM the buffers and structures of all modules reserve at compile time, see their IRIS_* capacities.
+//The ATmega32U4 has 2560 bytes. Of the 544 left, the Arduino core with its USB stack and the scalar
+//variables of the modules take about 320 (.data + .bss reported by avr-size, minus RESERVED_RAM),
+//which leaves about 220 for the stack. More bit planes need smaller capacities elsewhere
+#ifndef IRIS_RAM_BUDGET
+#define IRIS_RAM_BUDGET 2016
+#endif
+const size_t RESERVED_RAM =
+    sizeof(led_ring::frame_buffers) + sizeof(led_ring::presentation_times) + sizeof(led_ring::compares) +
+    sizeof(led_ring::channel_colors) + sizeof(led_ring::composed_colors) + sizeof(led_ring::channel_cache) +
+    sizeof(led_ring::timing_samples) + sizeof(led_ring::bcm_timings) + sizeof(led_ring::bcm_delay_correction_offset) +
+    sizeof(Cues::loaded_cues) + sizeof(Cues::render_plans) + sizeof(Cues::cache) + sizeof(Cues::mounted_medium) +
+    sizeof(Schedules::loaded_schedules) + sizeof(Schedules::loaded_periods) +
+    sizeof(Schedules::schedule_indices) + sizeof(Schedules::period_indices) + sizeof(Schedules::mounted_medium) +
+    sizeof(storage::current_header) + sizeof(storage::commit_header) + sizeof(storage::pending_bytes) +
+    sizeof(storage::element_queue) + sizeof(storage::source_cue) + sizeof(media::eeprom) +
+    sizeof(communication::rx_buffer) + sizeof(communication::tx_buffer) + sizeof(communication::nested_left) +
+    sizeof(communication::schedule_decoder) + sizeof(communication::replacement_cue) +
+    sizeof(communication::download_schedule) +
+    sizeof(calibrator::windows) + sizeof(calibrator::window_fill) + sizeof(calibrator::residual_error);
+//Types are larger on the host, where the firmware runs on the simulator
+#ifdef __AVR__
+static_assert(RESERVED_RAM <= IRIS_RAM_BUDGET, "Buffers don't fit into IRIS_RAM_BUDGET, lower the IRIS_* capacities");
+#endif
 
 uint8_t cue_index = 0;
 
-using namespace freilite::iris;
+//Time in ms between two frames
+const uint16_t FRAME_PERIOD = 20;
 
 void setup()
 {
@@ -41,32 +71,52 @@ void setup()
 
     storage::store_all_in_eeprom();
     #else
-    storage::load_all_from_eeprom();
+    storage::mount_eeprom();
     #endif
+    //Replacing a cue then only writes that cue, see storage::begin_mirror()
+    storage::begin_mirror();
 
     SerialUSB.begin(9600);
 
     led_ring::init();
-}
 
-//Delay in ms after which to repeat the main loop
-const uint16_t LOOP_DELAY = 20;
+    frame_scheduler::begin(FRAME_PERIOD);
+    //Fill the frame queue ahead of time, so a slow iteration doesn't delay frames
+    frame_scheduler::render_ahead(led_ring::FRAME_QUEUE_SIZE);
+}
 
 void loop()
 {
-    communication::handle_serial_io();
+    led_ring::set_display_time(millis());
+
+    //Handle serial I/O and calibrate the display in the time left until
+    //the next frame is due or while the frame queue is full
+    if(led_ring::queue_full() || !frame_scheduler::frame_due()){
+        communication::handle_serial_io();
+        calibrator::update();
+        return;
+    }
+
+    //Frames streamed by the host are displayed as they arrive instead of the schedule
+    if(communication::streaming()){
+        frame_scheduler::frame_done();
+        return;
+    }
+
+    uint32_t time = frame_scheduler::frame_time();
 
-    if(millis() % 3000 <= LOOP_DELAY){
-        cue_index = (cue_index + 1) % storage::number_of_cues();
+    if(time % 3000 < FRAME_PERIOD && Schedules::count()){
+        cue_index = (cue_index + 1) % Schedules::count();
     }
 
-    //led_ring::print_debug_info();
+    //calibrator::print_stats();
+    //frame_scheduler::print_stats();
 
     led_ring::reset_counters();
 
-    //led_ring::draw_cue(cue_index, millis());
+    //led_ring::draw_cue(cue_index, time); led_ring::update_frame(time);
 
-    led_ring::draw_schedule(cue_index, millis());
+    led_ring::draw_schedule(cue_index, time);
 
-    delay(LOOP_DELAY);
+    frame_scheduler::frame_done();
 }
\ No newline at end of file
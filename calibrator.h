@@ -0,0 +1,150 @@
+//Calibration of the BCM bit durations, in the main loop instead of the interrupt
+#pragma once
+
+#include <stdint.h>
+#include "Arduino.h"
+
+#include "led_ring.h"
+#include "serial_text.h"
+
+namespace freilite{
+namespace iris{
+namespace calibrator{
+    using led_ring::BCM_RESOLUTION;
+
+    //Number of samples per bit the median is taken of. Odd, so the median is one of them.
+    //Samples delayed by other interrupts are outliers and don't move the median
+    const uint8_t MEDIAN_WINDOW = 5;
+
+    //Statistics, reset by reset_stats()
+    //Number of corrections published
+    uint16_t rounds = 0;
+    //Measured minus target duration of each bit in timer counts, before the last correction
+    int16_t residual_error [BCM_RESOLUTION] = {};
+
+    namespace {
+        //Samples of each bit taken since the last correction
+        uint16_t windows [BCM_RESOLUTION][MEDIAN_WINDOW];
+        uint8_t window_fill [BCM_RESOLUTION] = {};
+        //Number of bits with a full window
+        uint8_t full_windows = 0;
+        //Set when bcm_delay_correction_offset changed and wasn't published yet
+        bool publish_needed = false;
+        //Set while waiting for the interrupt to use the published correction
+        bool correction_pending = false;
+
+        //Return median of window, sorting it
+        uint16_t median(uint16_t (&window)[MEDIAN_WINDOW]){
+            for(uint8_t i = 1; i < MEDIAN_WINDOW; i++){
+                uint16_t value = window[i];
+                uint8_t j = i;
+                for(; j > 0 && window[j - 1] > value; j--){
+                    window[j] = window[j - 1];
+                }
+                window[j] = value;
+            }
+            return window[MEDIAN_WINDOW / 2];
+        }
+
+        //Correct bit by the error measured on it
+        void correct(uint8_t bit, int16_t error){
+            residual_error[bit] = error;
+
+            //The measured duration follows the correction one to one, so the whole error
+            //is corrected at once. Only the median is used, so noise doesn't make it oscillate
+            int32_t offset = int32_t(led_ring::bcm_delay_correction_offset[bit]) + error;
+            int32_t max_offset = led_ring::BCM_BRIGHTNESS_MAP[bit] - 1;
+            led_ring::bcm_delay_correction_offset[bit] = offset < 0 ? 0 : offset > max_offset ? max_offset : offset;
+        }
+
+        //Publish the delay correction as soon as the one published before is in use.
+        //Returns false while waiting for the interrupt to use it
+        bool publish_correction(){
+            if(publish_needed){
+                if(!led_ring::publish_bcm_timing()) return false;
+                publish_needed = false;
+                correction_pending = true;
+            }
+            if(correction_pending){
+                if(led_ring::timing_pending()) return false;
+                //Samples taken before the correction was in use would be corrected for twice
+                led_ring::drop_timing_samples();
+                correction_pending = false;
+            }
+            return true;
+        }
+    }
+
+    void reset_stats(){
+        rounds = 0;
+        memset(residual_error, 0, sizeof(residual_error));
+        //Counted by the interrupt, 16 bits aren't written at once
+        uint8_t old_sreg = SREG;
+        cli();
+        led_ring::dropped_timing_samples = 0;
+        SREG = old_sreg;
+    }
+
+    //Forget the delay correction and all samples, and calibrate from scratch
+    void restart(){
+        memset(led_ring::bcm_delay_correction_offset, 0, sizeof(led_ring::bcm_delay_correction_offset));
+        memset(window_fill, 0, sizeof(window_fill));
+        full_windows = 0;
+        publish_needed = true;
+        reset_stats();
+    }
+
+    //Evaluate timing samples queued by the interrupt. Once there are enough of every bit,
+    //the delay correction is updated and published for the next frame.
+    //Should be polled in the slack of each frame
+    void update(){
+        if(!publish_correction()){
+            //Samples taken before the correction is in use are of no use
+            led_ring::drop_timing_samples();
+            return;
+        }
+
+        //The queue is always drained, so dropped_timing_samples only counts samples
+        //the main loop was too slow for. Samples of bits with a full window are discarded
+        led_ring::timing_sample_t sample;
+        while(led_ring::pop_timing_sample(sample)){
+            //The sample measured the bit before the one that started
+            uint8_t bit = sample.bit ? sample.bit - 1 : BCM_RESOLUTION - 1;
+            if(window_fill[bit] == MEDIAN_WINDOW) continue;
+
+            windows[bit][window_fill[bit]] = sample.count;
+            if(++window_fill[bit] == MEDIAN_WINDOW) ++full_windows;
+        }
+        if(full_windows < BCM_RESOLUTION) return;
+
+        for(uint8_t bit = 0; bit < BCM_RESOLUTION; bit++){
+            correct(bit, int16_t(median(windows[bit]) - led_ring::BCM_BRIGHTNESS_MAP[bit]));
+            window_fill[bit] = 0;
+        }
+        full_windows = 0;
+
+        publish_needed = true;
+        ++rounds;
+        publish_correction();
+    }
+
+    //Write calibration state to SerialUSB connection
+    void print_stats(){
+        uint8_t old_sreg = SREG;
+        cli();
+        uint16_t dropped_samples = led_ring::dropped_timing_samples;
+        SREG = old_sreg;
+        communication::printf(F("Corrections: %u, dropped samples: %u\n"), rounds, dropped_samples);
+        for(uint8_t bit = 0; bit < BCM_RESOLUTION; bit++){
+            communication::printf(
+                F("Bit %2u: BrtMp %6u, Corrc %6u, Error %4d\n"),
+                bit,
+                led_ring::BCM_BRIGHTNESS_MAP[bit],
+                led_ring::bcm_delay_correction_offset[bit],
+                residual_error[bit]
+            );
+        }
+    }
+}
+}
+}
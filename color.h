@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <Arduino.h>
 
 #include <pb_encode.h>
 #include <pb_decode.h>
@@ -17,6 +18,88 @@ struct Color{
     uint8_t B;
 };
 
+//Struct for storing colors as hue, saturation and lightness
+struct HSL{
+    uint16_t H; //0 to HUE_RANGE - 1, one sextant of the colour wheel per 256 steps
+    uint8_t S;
+    uint8_t L;
+};
+
+const uint16_t HUE_RANGE = 6 * 256;
+
+namespace {
+    //Allowed values in HUE_SEXTANT_MAP
+    enum HueComponent : uint8_t{
+        Chroma,
+        Second, //second largest component
+        Zero
+    };
+
+    //For each sextant of the colour wheel, store which value red, green and blue get
+    const PROGMEM uint8_t HUE_SEXTANT_MAP [6][3] = {
+        { Chroma, Second, Zero   }, //red to yellow
+        { Second, Chroma, Zero   }, //yellow to green
+        { Zero,   Chroma, Second }, //green to cyan
+        { Zero,   Second, Chroma }, //cyan to blue
+        { Second, Zero,   Chroma }, //blue to magenta
+        { Chroma, Zero,   Second }  //magenta to red
+    };
+
+    //Divide by 255 without division, exact for all values up to 65535
+    inline uint16_t div255(uint16_t value){
+        return (value + 1 + (value >> 8)) >> 8;
+    }
+}
+
+//Convert to HSL. Uses divisions, so it should not be called for every frame
+HSL rgb_to_hsl(Color color){
+    uint8_t max = color.R > color.G ? (color.R > color.B ? color.R : color.B) : (color.G > color.B ? color.G : color.B);
+    uint8_t min = color.R < color.G ? (color.R < color.B ? color.R : color.B) : (color.G < color.B ? color.G : color.B);
+    uint16_t sum = max + min;
+    uint8_t chroma = max - min;
+
+    HSL result;
+    result.L = sum / 2;
+    if(chroma == 0){
+        result.H = 0;
+        result.S = 0;
+        return result;
+    }
+
+    result.S = (chroma * 255UL) / (sum <= 255 ? sum : 510 - sum);
+
+    int16_t hue;
+    if(max == color.R){
+        hue = ((int16_t(color.G) - color.B) * 256) / chroma;
+    } else if(max == color.G){
+        hue = 2 * 256 + ((int16_t(color.B) - color.R) * 256) / chroma;
+    } else {
+        hue = 4 * 256 + ((int16_t(color.R) - color.G) * 256) / chroma;
+    }
+    result.H = hue < 0 ? hue + HUE_RANGE : hue;
+    return result;
+}
+
+//Convert to RGB using only multiplications, shifts and a table lookup
+Color hsl_to_rgb(HSL color){
+    uint8_t lightness_distance = color.L < 128 ? color.L : 255 - color.L;
+    uint8_t chroma = div255(uint16_t(2 * lightness_distance) * color.S);
+
+    uint8_t sextant = color.H >> 8;
+    uint8_t fraction = color.H & 0xFF;
+    //Second largest component rises in even sextants and falls in odd ones
+    uint8_t second = (uint16_t(chroma) * (sextant & 1 ? 256 - fraction : fraction)) >> 8;
+    uint8_t minimum = color.L - chroma / 2;
+
+    uint8_t values[3] = { [Chroma] = chroma, [Second] = second, [Zero] = 0 };
+    uint8_t components[3];
+    for(uint8_t i = 0; i < 3; i++){
+        uint16_t component = minimum + values[pgm_read_byte(&HUE_SEXTANT_MAP[sextant][i])];
+        components[i] = component > 255 ? 255 : component;
+    }
+    return { components[0], components[1], components[2] };
+}
+
 // This is not a member function because the color class will be swapped
 // out at some point
 pb::Cue_Color color_to_pb_color(Color color){
@@ -30,4 +113,13 @@ pb::Cue_Color color_to_pb_color(Color color){
     return pb_color;
 }
 
+// Inverse of color_to_pb_color, components are clipped to 255
+Color pb_color_to_color(const pb::Cue_Color& pb_color){
+    return {
+        uint8_t(pb_color.red < 255 ? pb_color.red : 255),
+        uint8_t(pb_color.green < 255 ? pb_color.green : 255),
+        uint8_t(pb_color.blue < 255 ? pb_color.blue : 255)
+    };
+}
+
 }
\ No newline at end of file
@@ -6,7 +6,11 @@
 
 #include <ArduinoSTL.h>
 
-//#include "storage.h"
+#include "cue.h"
+#include "led_ring.h"
+#include "schedule.h"
+#include "serial_text.h"
+#include "storage.h"
 
 #include <pb_encode.h>
 #include <pb_decode.h>
@@ -25,83 +29,447 @@ namespace communication{
 
     using namespace pb;
 
-    // Print just like std::printf but from a string stored in program
-    // memory and with leading EOT, see iris.proto for details
-    // Should always be used instead of std::printf
-    int printf(const __FlashStringHelper* format, ... ){
-        // Convert back from pseudo-class to pointer to program memory
-        const char* flash_string_pgm_ptr = reinterpret_cast<const char*>(format);
-        size_t string_length = strlen_P(flash_string_pgm_ptr);
+    // Size of the buffer for received bytes, needs to hold a complete message
+    // including its length prefix, up to 72 bytes for a cue. Only schedules of an upload may be larger
+    #ifndef IRIS_RX_BUFFER_SIZE
+    #define IRIS_RX_BUFFER_SIZE 96
+    #endif
 
-        // Initialise buffer
-        std::string buffer = std::string(string_length + 1, '\0');
+    // Number of received messages that were too large for the buffer or couldn't be decoded
+    uint16_t rejected_messages = 0;
 
-        // Write leading EOT to buffer
-        buffer[0] = '\x04';
+    namespace {
+        // Bytes received, but not decoded yet. Wraps around at the end
+        uint8_t rx_buffer[IRIS_RX_BUFFER_SIZE];
+        uint16_t rx_begin = 0;
+        uint16_t rx_length = 0;
+        // Bytes of a rejected message that still have to be thrown away as they arrive
+        uint32_t rx_discard = 0;
+        // Position of the decoder relative to rx_begin
+        uint16_t rx_read_offset = 0;
+
+        // Return received byte at offset from the beginning of the buffer
+        uint8_t rx_at(uint16_t offset){
+            uint16_t index = rx_begin + offset;
+            return rx_buffer[index < IRIS_RX_BUFFER_SIZE ? index : index - IRIS_RX_BUFFER_SIZE];
+        }
 
-        // Load string from progmem to buffer
-        for(int i = 0; i < string_length; ++i){
-            buffer[i+1] = pgm_read_byte(flash_string_pgm_ptr + i);
+        // Copy count received bytes starting at offset to destination
+        void rx_copy(uint16_t offset, uint8_t* destination, uint16_t count){
+            uint16_t index = rx_begin + offset;
+            if(index >= IRIS_RX_BUFFER_SIZE) index -= IRIS_RX_BUFFER_SIZE;
+            uint16_t until_end = IRIS_RX_BUFFER_SIZE - index;
+            if(count <= until_end){
+                memcpy(destination, rx_buffer + index, count);
+                return;
+            }
+            memcpy(destination, rx_buffer + index, until_end);
+            memcpy(destination + until_end, rx_buffer, count - until_end);
         }
 
-        // Execute stl implementation of printf
-        va_list arglist;
-        va_start(arglist, format);
-        int num_written = std::vprintf(buffer.c_str(), arglist);
-        va_end(arglist);
-        return num_written;
-    }
+        // Remove count bytes from the beginning of the buffer
+        void rx_consume(uint16_t count){
+            rx_begin += count;
+            if(rx_begin >= IRIS_RX_BUFFER_SIZE) rx_begin -= IRIS_RX_BUFFER_SIZE;
+            rx_length -= count;
+        }
 
-    namespace {
-        // Read protobuf data into buffer from serial connection
-        static bool read_callback(pb_istream_t* stream,
+        // Read protobuf data of the current message from rx_buffer
+        static bool read_callback(pb_istream_t*,
                                   uint8_t* buf,
                                   size_t count){
-            int bytes_read = 0;
-            for(;bytes_read < count; ++bytes_read){
-                if(!SerialUSB.available()){
-                    // Reached end of data
-                    buf[bytes_read] = 0;
-                    stream->bytes_left = 0;
-                } else {
-                    // Read data into buffer
-                    buf[bytes_read] = SerialUSB.read();
-                }
+            for(size_t i = 0; i < count; ++i){
+                buf[i] = rx_at(rx_read_offset++);
             }
-
-            return count == bytes_read;
+            return true;
         }
 
-        // Decoder for protobuf messages
-        pb_istream_t pb_serial_in = {&read_callback,
-                                         nullptr,
-                                         MAX_SIZE_PB_BUFFER};
-
         // Write protobuf data onto serial connection
-        static bool write_callback(pb_ostream_t* stream,
+        static bool write_callback(pb_ostream_t*,
                                    const uint8_t* buf,
                                    size_t count){
+            // Keep text and messages in order
+            flush_all();
             return SerialUSB.write(buf, count) == count;
         }
 
-        // Encoder for protobuf messages
-        pb_ostream_t pb_serial_out = {&write_callback,
-                                          nullptr,
-                                          MAX_SIZE_PB_BUFFER};
+        // Parse the varint received at offset, at most 5 bytes long as all fields are 32 bit.
+        // Returns false if it wasn't received completely yet. A longer
+        // varint can't be valid, value is UINT32_MAX and size 5 then
+        bool rx_varint(uint16_t offset, uint32_t& value, uint8_t& size){
+            value = 0;
+            for(size = 0; offset + size < rx_length && size < 5; ++size){
+                uint8_t byte = rx_at(offset + size);
+                value |= uint32_t(byte & 0x7F) << (7 * size);
+                if(!(byte & 0x80)){
+                    ++size;
+                    return true;
+                }
+            }
+            if(size == 5){
+                value = UINT32_MAX;
+                return true;
+            }
+            return false;
+        }
+
+        // Parse the length prefix of the first message in rx_buffer.
+        // Returns false if it wasn't received completely yet
+        bool frame_length(uint32_t& length, uint8_t& prefix_size){
+            // A prefix longer than 5 bytes rejects everything received
+            return rx_varint(0, length, prefix_size);
+        }
+    }
+
+    // Move received bytes from the serial connection to rx_buffer.
+    // Never blocks, should be called regularly
+    void poll(){
+        while(SerialUSB.available()){
+            if(rx_discard){
+                SerialUSB.read();
+                --rx_discard;
+                continue;
+            }
+            if(rx_length == IRIS_RX_BUFFER_SIZE) return;
+
+            uint16_t index = rx_begin + rx_length;
+            if(index >= IRIS_RX_BUFFER_SIZE) index -= IRIS_RX_BUFFER_SIZE;
+            rx_buffer[index] = SerialUSB.read();
+            ++rx_length;
+        }
+    }
+
+    // Starts an upload of a complete configuration: every cue, then every
+    // schedule and finally Confirm, the same sequence a download sends.
+    // Each item is staged in EEPROM as soon as it arrives, see storage::stage_cue,
+    // and Confirm commits them. So the configuration has to fit into half the EEPROM
+    // and its periods into IRIS_MAX_PERIODS. The configuration in use is shown
+    // until the commit is done, then Confirm is replied.
+    // Not part of iris.proto yet, the host library has to send this value
+    const MessageData_Signal MessageData_Signal_UploadConfiguration =
+        static_cast<MessageData_Signal>(6);
+    // Starts an upload replacing a single cue: one cue follows, then
+    // Confirm commits it to EEPROM. Once the configuration in use was copied to the
+    // other half of the EEPROM, see storage::begin_mirror, only the cue and the header
+    // are written. Sent as REPLACE_CUE_SIGNALS + cue ID,
+    // which doesn't fit into MessageData_Signal, see decode_message
+    const MessageData_Signal MessageData_Signal_ReplaceCue =
+        static_cast<MessageData_Signal>(7);
+    const uint16_t REPLACE_CUE_SIGNALS = 0x100;
+
+    namespace {
+        // Cue ID of the last ReplaceCue signal received
+        uint8_t requested_cue_id = 0;
+        // Channels of the last cue received, see Cue::prepare_pb_cue
+        uint16_t received_channels = 0;
+        // While set, schedules are decoded and staged in EEPROM
+        // instead of being skipped, see decode_schedule_field
+        bool stream_schedules = false;
+        Schedules::decoder_t schedule_decoder;
+        // Number of cues and schedule elements staged by a configuration upload
+        uint16_t staged_cues = 0;
+        uint16_t staged_elements = 0;
+
+        // Stage the elements of uploaded schedules as they are decoded
+        bool stage_schedule_element(delay_t element){
+            return storage::stage_element(staged_cues, staged_elements++, element);
+        }
+
+        // Decode a length-delimited submessage of the current message
+        bool decode_submessage(pb_istream_t* stream, const pb_field_t fields[], void* destination){
+            pb_istream_t substream;
+            if(!pb_make_string_substream(stream, &substream)) return false;
+            bool decoded = pb_decode(&substream, fields, destination);
+            pb_close_string_substream(stream, &substream);
+            return decoded;
+        }
+
+        // Decode MessageData field by field, so the callbacks of a contained
+        // cue can be set up before it is decoded. Schedules of an upload
+        // are decoded by decode_schedule_field instead
+        bool decode_message(pb_istream_t* stream, MessageData& message){
+            pb_wire_type_t wire_type;
+            uint32_t tag;
+            bool eof;
+            while(pb_decode_tag(stream, &wire_type, &tag, &eof)){
+                if(tag == MessageData_signal_tag && wire_type == PB_WT_VARINT){
+                    uint64_t signal;
+                    if(!pb_decode_varint(stream, &signal)) return false;
+                    if(signal >= REPLACE_CUE_SIGNALS && signal < REPLACE_CUE_SIGNALS + 0x100){
+                        requested_cue_id = signal - REPLACE_CUE_SIGNALS;
+                        signal = MessageData_Signal_ReplaceCue;
+                    }
+                    // Unknown values beyond MessageData_Signal can't be stored in it
+                    if(signal > MessageData_Signal_ReplaceCue) return false;
+                    message.which_content = MessageData_signal_tag;
+                    message.content.signal = static_cast<MessageData_Signal>(signal);
+                } else if(tag == MessageData_cue_tag && wire_type == PB_WT_STRING){
+                    message.which_content = MessageData_cue_tag;
+                    Cue::prepare_pb_cue(message.content.cue, &received_channels);
+                    if(!decode_submessage(stream, Cue_fields, &message.content.cue)) return false;
+                } else {
+                    // Not expected right now, handle_message replies with an Error
+                    if(tag == MessageData_schedule_tag){
+                        message.which_content = MessageData_schedule_tag;
+                        schedule_decoder.periods = 0;
+                    }
+                    if(!pb_skip_field(stream, wire_type)) return false;
+                }
+            }
+            return eof;
+        }
+
+        // Schedules of a configuration upload are decoded field by field as they
+        // arrive instead of as a whole message, so they may be larger than rx_buffer.
+        // Each element is staged as soon as it is decoded, so they are never held in RAM
+        // as a whole. Submessages are nested at most this deep
+        enum class nesting_t : uint8_t {message, schedule, period, delays};
+        const uint8_t NESTING_LEVELS = 4;
+        // Set while the rest of a schedule message is expected in rx_buffer
+        bool decoding_schedule = false;
+        nesting_t nesting = nesting_t::message;
+        // Bytes left of the submessage decoded at each level, including the levels below
+        uint32_t nested_left[NESTING_LEVELS];
+        // Bytes of an unknown field that are skipped as they arrive
+        uint32_t schedule_skip = 0;
+
+        enum class field_result_t : uint8_t {decoded, incomplete, invalid};
+
+        // Remove count bytes of the schedule message from rx_buffer
+        void consume_schedule(uint16_t count){
+            rx_consume(count);
+            for(uint8_t level = 0; level <= uint8_t(nesting); ++level) nested_left[level] -= count;
+        }
+
+        // Throw away the rest of the schedule message, including bytes still to arrive
+        void discard_schedule(){
+            if(!decoding_schedule) return;
+            decoding_schedule = false;
+            uint16_t count = nested_left[0] < rx_length ? nested_left[0] : rx_length;
+            rx_consume(count);
+            rx_discard = nested_left[0] - count;
+        }
+
+        // Decode the next field of the schedule message, or end the submessage it completes
+        field_result_t decode_schedule_field(){
+            uint8_t level = uint8_t(nesting);
+            if(schedule_skip){
+                uint16_t count = schedule_skip < rx_length ? schedule_skip : rx_length;
+                consume_schedule(count);
+                schedule_skip -= count;
+                return schedule_skip ? field_result_t::incomplete : field_result_t::decoded;
+            }
+            if(nested_left[level] == 0){
+                if(nesting == nesting_t::period && !Schedules::end_period(schedule_decoder)){
+                    return field_result_t::invalid;
+                }
+                nesting = nesting_t(level - 1);
+                return field_result_t::decoded;
+            }
+
+            uint32_t value;
+            uint8_t size;
+            // Packed delays are a plain sequence of varints
+            if(nesting == nesting_t::delays){
+                if(!rx_varint(0, value, size)) return field_result_t::incomplete;
+                if(size > nested_left[level]) return field_result_t::invalid;
+                consume_schedule(size);
+                return Schedules::push_delay(schedule_decoder, value) ? field_result_t::decoded : field_result_t::invalid;
+            }
+
+            // Key of the field, followed by the value of a varint or the length of a string
+            uint32_t key;
+            uint8_t header_size;
+            if(!rx_varint(0, key, header_size)) return field_result_t::incomplete;
+            uint8_t wire_type = key & 0x07;
+            uint32_t tag = key >> 3;
+            uint32_t length = 0;
+            if(wire_type == PB_WT_VARINT || wire_type == PB_WT_STRING){
+                if(!rx_varint(header_size, value, size)) return field_result_t::incomplete;
+                header_size += size;
+                if(wire_type == PB_WT_STRING) length = value;
+            } else if(wire_type == PB_WT_32BIT){
+                length = 4;
+            } else if(wire_type == PB_WT_64BIT){
+                length = 8;
+            } else {
+                return field_result_t::invalid;
+            }
+            if(header_size > nested_left[level] || length > nested_left[level] - header_size){
+                return field_result_t::invalid;
+            }
+            consume_schedule(header_size);
+
+            if(wire_type == PB_WT_VARINT){
+                if(nesting == nesting_t::schedule && tag == Schedule_duration_tag){
+                    schedule_decoder.duration = value;
+                } else if(nesting == nesting_t::period && tag == Schedule_Period_cue_id_tag){
+                    schedule_decoder.cue_id = value;
+                } else if(nesting == nesting_t::period && tag == Schedule_Period_delays_tag){
+                    if(!Schedules::push_delay(schedule_decoder, value)) return field_result_t::invalid;
+                }
+                return field_result_t::decoded;
+            }
+            bool submessage = wire_type == PB_WT_STRING &&
+                ((nesting == nesting_t::message && tag == MessageData_schedule_tag) ||
+                 (nesting == nesting_t::schedule && tag == Schedule_periods_tag) ||
+                 (nesting == nesting_t::period && tag == Schedule_Period_delays_tag));
+            if(!submessage){
+                schedule_skip = length;
+                return field_result_t::decoded;
+            }
+            nesting = nesting_t(level + 1);
+            nested_left[level + 1] = length;
+            if(nesting == nesting_t::period) Schedules::begin_period(schedule_decoder);
+            return field_result_t::decoded;
+        }
+
+        // Start decoding a schedule message of length bytes, its length prefix was consumed
+        void begin_schedule(uint32_t length){
+            decoding_schedule = true;
+            nesting = nesting_t::message;
+            nested_left[0] = length;
+            schedule_skip = 0;
+            Schedules::begin_decoding(schedule_decoder, &stage_schedule_element);
+        }
+
+        // Decode the fields of the schedule message received so far.
+        // Returns true once the message was decoded completely. Pauses
+        // while staged elements are written, see storage::stage_step
+        bool continue_schedule(MessageData& message){
+            while(true){
+                if(storage::stage_step()) return false;
+                if(nesting == nesting_t::message && nested_left[0] == 0 && !schedule_skip){
+                    decoding_schedule = false;
+                    message = MessageData_init_default;
+                    message.which_content = MessageData_schedule_tag;
+                    return true;
+                }
+                field_result_t result = decode_schedule_field();
+                if(result == field_result_t::incomplete) return false;
+                if(result == field_result_t::invalid){
+                    discard_schedule();
+                    ++rejected_messages;
+                    return false;
+                }
+            }
+        }
+    }
+
+    // Decode the next message if it was received completely.
+    // Every message is prefixed with its length as a varint,
+    // as written by pb_encode_delimited. Never blocks
+    bool receive_message(MessageData& message){
+        if(decoding_schedule) return continue_schedule(message);
+
+        uint32_t length;
+        uint8_t prefix_size;
+        if(!frame_length(length, prefix_size)) return false;
+
+        uint16_t received = rx_length - prefix_size;
+        if(stream_schedules && length != UINT32_MAX){
+            // The key tells whether the message has to fit into rx_buffer
+            if(received == 0) return false;
+            if(rx_at(prefix_size) == ((MessageData_schedule_tag << 3) | PB_WT_STRING)){
+                rx_consume(prefix_size);
+                begin_schedule(length);
+                return continue_schedule(message);
+            }
+        }
+        if(length > uint16_t(IRIS_RX_BUFFER_SIZE - prefix_size)){
+            // Can never be received completely, throw it away
+            if(length != UINT32_MAX && length > received){
+                rx_discard = length - received;
+            }
+            rx_consume(rx_length);
+            ++rejected_messages;
+            return false;
+        }
+        if(received < length) return false;
+
+        message = MessageData_init_default;
+        rx_read_offset = prefix_size;
+        pb_istream_t stream = {&read_callback, nullptr, length, nullptr};
+        bool decoded = decode_message(&stream, message);
+        rx_consume(prefix_size + length);
+        if(!decoded) ++rejected_messages;
+        return decoded;
+    }
+
+    // Frames streamed by the host are sent as raw packets instead of messages,
+    // decoding them with nanopb would limit the frame rate. A packet starts with
+    // FRAME_PACKET_MARKER where a message has its length prefix, which
+    // is never sent for messages as they would be empty. The marker is followed
+    // by a sequence number, counting up by one per frame, and the colour components
+    // of all channels in the order of led_ring::channel_colors
+    const uint8_t FRAME_PACKET_MARKER = 0x00;
+    const uint8_t FRAME_PACKET_HEADER_SIZE = 2;
+    const uint8_t FRAME_PACKET_SIZE = FRAME_PACKET_HEADER_SIZE + sizeof(led_ring::channel_colors);
+    static_assert(FRAME_PACKET_SIZE <= IRIS_RX_BUFFER_SIZE, "Frame packets need to fit into rx_buffer");
+    // Streaming ends if no frame was received for this many ms, then the schedule is drawn again
+    const uint16_t STREAM_TIMEOUT = 500;
+
+    // Statistics of the current or last stream, reported when it ends
+    uint16_t streamed_frames = 0;
+    // Frames missing from the sequence
+    uint16_t dropped_stream_frames = 0;
+    // Frames replaced by the next one before the interrupt displayed them
+    uint16_t late_stream_frames = 0;
+
+    namespace {
+        bool stream_active = false;
+        // Sequence number the next frame should have
+        uint8_t next_sequence = 0;
+        // Time in ms at which the stream ends if no frame was received
+        uint32_t stream_deadline = 0;
+
+        // Display the frame packet at the beginning of rx_buffer.
+        // Returns false if there is none, but true if it wasn't received
+        // completely yet, so it isn't taken for a message
+        bool receive_frame(){
+            // Schedules may contain the marker, see decode_schedule_field
+            if(rx_length == 0 || decoding_schedule || rx_at(0) != FRAME_PACKET_MARKER) return false;
+            if(rx_length < FRAME_PACKET_SIZE) return true;
+
+            uint8_t sequence = rx_at(1);
+            // The previous frame of the stream wasn't displayed yet and is replaced
+            if(stream_active && led_ring::queued_frames) ++late_stream_frames;
+            // Streamed frames are shown as they arrive, not after frames rendered ahead
+            led_ring::drop_queued_frames();
+            if(!stream_active){
+                stream_active = true;
+                next_sequence = sequence;
+                streamed_frames = 0;
+                dropped_stream_frames = 0;
+                late_stream_frames = 0;
+            }
+            dropped_stream_frames += uint8_t(sequence - next_sequence);
+            next_sequence = sequence + 1;
+            ++streamed_frames;
+            stream_deadline = millis() + STREAM_TIMEOUT;
+
+            // Converted straight into a frame buffer, skipping draw_led()
+            rx_copy(FRAME_PACKET_HEADER_SIZE, &led_ring::channel_colors[0][0], sizeof(led_ring::channel_colors));
+            rx_consume(FRAME_PACKET_SIZE);
+            led_ring::frame_dirty = true;
+            led_ring::update_frame();
+            return true;
+        }
     }
 
-    MessageData receive_message(){
-        MessageData message = MessageData_init_default;
-        pb_decode(&pb_serial_in,
-                          MessageData_fields,
-                          &message);
-        return message;
+    // Return true while the host streams frames, nothing else may be drawn then
+    bool streaming(){
+        return stream_active;
     }
 
+    // Send message, framed by MESSAGE_MARKER and its length, see serial_text.h
     void send_message(const MessageData& message){
-        pb_encode(&pb_serial_out,
-                          MessageData_fields,
-                          &message);
+        flush_all();
+        SerialUSB.write(uint8_t(MESSAGE_MARKER));
+        pb_ostream_t stream = {&write_callback, nullptr, MAX_SIZE_PB_BUFFER, 0, nullptr};
+        pb_encode_delimited(&stream,
+                            MessageData_fields,
+                            &message);
     }
 
     void send_message(MessageData_Signal signal){
@@ -128,74 +496,261 @@ namespace communication{
         send_message(message_data);
     }
 
-    // Check if message is incoming
-    // Blocks for no more than RECEIVE_TIMEOUT milliseconds
-    bool message_incoming(){
-        const size_t TIMESTEP = 3;
-        unsigned long milliseconds = 0;
-        while(!SerialUSB.available()){
-            delay(TIMESTEP);
-            milliseconds += TIMESTEP;
-            if(milliseconds > RECEIVE_TIMEOUT){
-                printf(F("Timeout reached: %ims"), milliseconds);
-                return false;
+    void handle_info(){
+        printf(F("Communication works!"));
+    }
+
+    // Requests a download like DownloadConfiguration, but the host doesn't wait for
+    // each item before requesting the next: up to DOWNLOAD_WINDOW items are sent
+    // ahead of the RequestNext signals acknowledging them.
+    // Not part of iris.proto yet, the host library has to send this value
+    const MessageData_Signal MessageData_Signal_DownloadConfigurationWindowed =
+        static_cast<MessageData_Signal>(5);
+    // Items sent during a windowed download that haven't been acknowledged yet
+    const uint8_t DOWNLOAD_WINDOW = 8;
+
+    namespace {
+        // Progress of a download. Every cue, then every schedule and finally
+        // Confirm is sent, see handle_download_configuration
+        bool downloading = false;
+        // Next item to send and number of items acknowledged by RequestNext
+        uint16_t download_item = 0;
+        uint16_t download_acknowledged = 0;
+        // RequestNext signals still on their way after a windowed download ended with Confirm,
+        // they are accepted without a reply
+        uint8_t late_acknowledgements = 0;
+        // Number of items that may be sent before they are acknowledged
+        uint8_t download_window = 1;
+        // Time in ms at which the download is aborted if nothing was requested
+        uint32_t download_deadline = 0;
+
+        // Schedule being sent, as_pb_schedule refers to it until it is encoded
+        Schedule download_schedule = Schedule(0);
+
+        // Return message for item of the download, Confirm after the last one
+        MessageData download_message(uint16_t item){
+            MessageData message_data = MessageData_init_default;
+            uint16_t num_cues = Cues::count();
+            uint16_t num_schedules = Schedules::count();
+            if(item < num_cues){
+                message_data.which_content = MessageData_cue_tag;
+                message_data.content.cue = Cues::get(item).as_pb_cue();
+            } else if(item < num_cues + num_schedules){
+                message_data.which_content = MessageData_schedule_tag;
+                download_schedule = Schedule(item - num_cues);
+                message_data.content.schedule = download_schedule.as_pb_schedule();
+            } else {
+                // Confirm signal indicates end of transmission
+                message_data.which_content = MessageData_signal_tag;
+                message_data.content.signal = MessageData_Signal_Confirm;
             }
+            return message_data;
         }
-        return true;
-    }
 
-    // Wait for the next signal and return true if it's
-    bool next_requested(){
-        if(!message_incoming()){
-            return false;
+        // Send message only if the serial connection accepts it without blocking
+        bool send_message_without_blocking(const MessageData& message){
+            size_t size;
+            if(!pb_get_encoded_size(&size, MessageData_fields, &message)) return false;
+            // Marker and length prefix, the messages are too short for more than two bytes
+            size += size < 0x80 ? 2 : 3;
+            if(static_cast<size_t>(SerialUSB.availableForWrite()) < size + tx_length) return false;
+            send_message(message);
+            return true;
+        }
+
+        // Send as many items of the download as the window and the serial connection allow
+        void continue_download(){
+            uint16_t num_items = Cues::count() + Schedules::count();
+            while(downloading && download_item - download_acknowledged < download_window){
+                MessageData message = download_message(download_item);
+                if(!send_message_without_blocking(message)){
+                    // Everything sent before was received, so the item is larger
+                    // than the serial connection accepts at once. Wait for it instead
+                    if(download_item != download_acknowledged) return;
+                    send_message(message);
+                }
+                download_deadline = millis() + RECEIVE_TIMEOUT;
+                // Confirm isn't acknowledged
+                if(download_item == num_items){
+                    downloading = false;
+                    late_acknowledgements = download_item - download_acknowledged;
+                }
+                ++download_item;
+            }
         }
-        return receive_message().content.signal ==
-               MessageData_Signal_RequestNext;
     }
 
-    void handle_info(){
-        printf(F("Communication works!"));
+    // Start a download, window is the number of items sent ahead of
+    // being requested. With 1, every item is sent only after
+    // the previous one was acknowledged by RequestNext
+    void handle_download_configuration(uint8_t window = 1){
+        downloading = true;
+        download_item = 0;
+        download_acknowledged = 0;
+        late_acknowledgements = 0;
+        download_window = window;
+        continue_download();
     }
 
-    void handle_download_configuration(){
-        // Send cues
-        size_t num_cues = Cues::count();
-        for(int i = 0; i < num_cues; ++i){
-            send_message(Cues::get(i).as_pb_cue());
-            if(!next_requested()){
-                printf(F("Did not receive RequestNext."));
-                return;
+    namespace {
+        enum class upload_t : uint8_t{ none, configuration, cue };
+        upload_t upload = upload_t::none;
+        // Time in ms at which the upload is aborted if nothing was received
+        uint32_t upload_deadline = 0;
+        // Cue replaced by a ReplaceCue upload and its replacement
+        uint8_t replaced_cue_id = 0;
+        Cue replacement_cue;
+        bool replacement_received = false;
+        // Set while the upload is committed by storage::commit_step
+        bool committing = false;
+
+        // Cues as they are committed by a ReplaceCue upload
+        const Cue& cue_with_replacement(size_t cue_id){
+            return cue_id == replaced_cue_id ? replacement_cue : storage::peeked_cue(cue_id);
+        }
+
+        void start_upload(upload_t type){
+            upload = type;
+            upload_deadline = millis() + RECEIVE_TIMEOUT;
+            stream_schedules = type == upload_t::configuration;
+            replacement_received = false;
+            staged_cues = 0;
+            staged_elements = 0;
+            if(type == upload_t::configuration){
+                storage::begin_staging();
+                if(storage::staging_in_place()){
+                    Cues::clear();
+                    Schedules::clear();
+                }
             }
         }
 
-        // Send schedules
-        size_t num_schedules = Schedules::count();
-        for(int i = 0; i < num_schedules; ++i){
-            send_message(Schedule(i).as_pb_schedule());
-            if(!next_requested()){
-                printf(F("Did not receive RequestNext."));
+        void end_upload(){
+            upload = upload_t::none;
+            stream_schedules = false;
+            discard_schedule();
+            committing = false;
+        }
+
+        // Drop everything uploaded so far and go back to the configuration in EEPROM
+        void abort_upload(){
+            end_upload();
+            storage::mount_eeprom();
+            send_message(MessageData_Signal_Error);
+        }
+
+        // Start storing the upload in EEPROM. The previous configuration stays
+        // intact and is shown until the upload was written completely, see storage::begin_commit.
+        // Only then it is mounted, which verifies it
+        void commit_upload(){
+            bool started;
+            if(upload == upload_t::cue){
+                started = replacement_received && storage::begin_commit(&cue_with_replacement);
+            } else {
+                started = storage::begin_staged_commit(staged_cues, staged_elements);
+            }
+            if(!started){
+                end_upload();
+                storage::mount_eeprom();
+                send_message(MessageData_Signal_Error);
                 return;
             }
+            committing = true;
         }
 
-        // Send Confirm signal to indicate end of transmission
-        send_message(MessageData_Signal_Confirm);
-    }
+        // Write the next bytes of a staged cue or of the commit to EEPROM, never waits for it.
+        // Returns true while bytes are left, nothing else is received until then
+        bool continue_upload_write(){
+            if(!committing) return storage::stage_step();
+            if(storage::commit_step()) return true;
+            end_upload();
+            // Verifies what was written before it is shown
+            if(storage::mount_eeprom()){
+                storage::begin_mirror();
+                send_message(MessageData_Signal_Confirm);
+            } else {
+                send_message(MessageData_Signal_Error);
+            }
+            return false;
+        }
 
-    // Handle I/O
-    void handle_serial_io(){
-        // Don't do anything if there are no incoming requests
-        if(!SerialUSB.available()){
-            return;
+        // Handle request received during an upload. Returns false if
+        // it ended the upload and still needs to be handled as usual
+        bool handle_upload_message(const MessageData& request){
+            upload_deadline = millis() + RECEIVE_TIMEOUT;
+            if(request.which_content == MessageData_cue_tag){
+                Cue cue = Cue::from_pb_cue(request.content.cue, received_channels);
+                if(upload == upload_t::cue){
+                    replacement_cue = cue;
+                    replacement_received = true;
+                // All cues come before the first schedule
+                } else if(staged_elements != 0 || !storage::stage_cue(staged_cues, cue)){
+                    printf(F("Cue %u can't be loaded."), unsigned(staged_cues));
+                    abort_upload();
+                } else {
+                    ++staged_cues;
+                }
+                return true;
+            }
+            if(request.which_content == MessageData_schedule_tag){
+                // Was already staged while it was decoded
+                if(upload != upload_t::configuration || schedule_decoder.periods == 0){
+                    printf(F("Schedule %u can't be loaded."), unsigned(storage::staged_schedules));
+                    abort_upload();
+                }
+                return true;
+            }
+            if(request.content.signal == MessageData_Signal_Confirm){
+                commit_upload();
+                return true;
+            }
+            printf(F("Upload aborted."));
+            abort_upload();
+            return false;
         }
+    }
 
-        MessageData request = receive_message();
+    void handle_message(const MessageData& request){
+        if(upload != upload_t::none && handle_upload_message(request)) return;
 
         if(request.which_content != MessageData_signal_tag){
             send_message(MessageData_Signal_Error);
             return;
         }
 
+        if(downloading){
+            if(request.content.signal == MessageData_Signal_RequestNext){
+                if(download_acknowledged < download_item) ++download_acknowledged;
+                continue_download();
+                return;
+            }
+            printf(F("Did not receive RequestNext."));
+            downloading = false;
+        }
+        if(late_acknowledgements && request.content.signal == MessageData_Signal_RequestNext){
+            --late_acknowledgements;
+            return;
+        }
+
+        // Not part of the enum, so these can't be handled in the switch
+        if(request.content.signal == MessageData_Signal_DownloadConfigurationWindowed){
+            handle_download_configuration(DOWNLOAD_WINDOW);
+            return;
+        }
+        if(request.content.signal == MessageData_Signal_UploadConfiguration){
+            start_upload(upload_t::configuration);
+            return;
+        }
+        if(request.content.signal == MessageData_Signal_ReplaceCue){
+            replaced_cue_id = requested_cue_id;
+            if(replaced_cue_id >= Cues::count()){
+                send_message(MessageData_Signal_Error);
+                return;
+            }
+            start_upload(upload_t::cue);
+            return;
+        }
+
         switch(request.content.signal){
             case MessageData_Signal_RequestInfo:
                 handle_info();
@@ -215,6 +770,51 @@ namespace communication{
                 return;
         }
     }
+
+    // Handle I/O. Never waits for data, so it can be called
+    // in the time left between two frames without delaying them
+    void handle_serial_io(){
+        flush();
+        poll();
+
+        if(downloading && static_cast<int32_t>(millis() - download_deadline) > 0){
+            printf(F("Timeout reached: %ums"), unsigned(RECEIVE_TIMEOUT));
+            downloading = false;
+        }
+        if(stream_active && static_cast<int32_t>(millis() - stream_deadline) > 0){
+            stream_active = false;
+            printf(F("Stream ended: %u frames, %u dropped, %u late"),
+                   streamed_frames, dropped_stream_frames, late_stream_frames);
+        }
+        // The host waits while the upload is written
+        if(upload != upload_t::none && continue_upload_write()){
+            upload_deadline = millis() + RECEIVE_TIMEOUT;
+            return;
+        }
+        if(upload != upload_t::none && static_cast<int32_t>(millis() - upload_deadline) > 0){
+            printf(F("Timeout reached: %ums"), unsigned(RECEIVE_TIMEOUT));
+            abort_upload();
+        }
+        // Bring the half of the EEPROM not in use up to date, see storage::begin_mirror
+        if(upload == upload_t::none) storage::commit_step();
+
+        // Handle at most one message or frame per call, others stay buffered.
+        // Frames may arrive at any time, even during uploads and downloads
+        if(receive_frame()){
+            continue_download();
+            return;
+        }
+        MessageData request;
+        uint16_t rejected = rejected_messages;
+        if(receive_message(request)){
+            handle_message(request);
+        } else if(upload != upload_t::none && rejected != rejected_messages){
+            // Whatever the rejected message contained is missing from the upload
+            abort_upload();
+        }
+
+        continue_download();
+    }
 }
 }
 }
@@ -3,7 +3,9 @@
 
 #include <Arduino.h>
 
+#include "arena.h"
 #include "color.h"
+#include "medium.h"
 
 #include <pb_encode.h>
 #include <pb_decode.h>
@@ -23,24 +25,35 @@ namespace iris{
         linearHSL = 2
     };
 
+    //How the colour of a cue is combined with the cues drawn before it on the same
+    //channel, see led_ring::blend_cue(). Not part of the protobuf definition yet
+    enum class BlendMode : uint8_t{
+        replace = 0,
+        add = 1, //saturating
+        multiply = 2,
+        max = 3
+    };
+
     struct Cue{
-        uint16_t channels : 12; //bitmask, currently unused
+        uint16_t channels : 12; //bitmask of the channels the cue is drawn on
         bool reverse : 1;
-        bool wrap_hue : 1;
+        bool wrap_hue : 1; //linearHSL takes the longer way around the colour wheel
+        BlendMode blend_mode : 2;
         uint8_t time_divisor;
-        uint16_t delay; //currently unused
+        uint16_t delay; //in ms the effect lags behind the time it is drawn at
         uint32_t duration; //in ms
         RampType ramp_type;
         uint32_t ramp_parameter; //Maximum is equal to duration
 
         Color start_color;
         Color end_color;
-        Color offset_color; //currently unused
+        Color offset_color; //added to the colour of the effect, saturating
 
         Cue() :
             channels(0b111111111111),
             reverse(false),
             wrap_hue(false),
+            blend_mode(BlendMode::replace),
             time_divisor(12),
             delay(0),
             duration(1000),
@@ -53,11 +66,7 @@ namespace iris{
         {}
 
         Color interpolate(uint32_t time, uint8_t channel){
-            channel = reverse ? channel : 11 - channel;
-            time += ( duration / time_divisor ) * channel;
-
-            //effect will restart
-            time = time % duration;
+            time = phase(time, channel);
 
             Color result{};
             switch(ramp_type){
@@ -67,26 +76,102 @@ namespace iris{
                     } else {
                         return start_color;
                     }
-                case RampType::linearHSL:
-                    //NOT IMPLEMENTED YET!
-                    return {255, 255, 255};
+                case RampType::linearHSL:{
+                    HSL start = rgb_to_hsl(start_color);
+                    HSL end = rgb_to_hsl(end_color);
+                    uint16_t start_hue, end_hue;
+                    hue_path(start.H, end.H, start_hue, end_hue);
+
+                    HSL hsl;
+                    hsl.H = linear_transition(start_hue, end_hue, time) % HUE_RANGE;
+                    hsl.S = linear_transition(start.S, end.S, time);
+                    hsl.L = linear_transition(start.L, end.L, time);
+                    return hsl_to_rgb(hsl);
+                }
                 case RampType::linearRGB:
                     result.R = linear_transition(start_color.R, end_color.R, time);
                     result.G = linear_transition(start_color.G, end_color.G, time);
                     result.B = linear_transition(start_color.B, end_color.B, time);
                     return result;
             }
+            return result;
+        }
+
+        //Shift start and end hue of an HSL ramp so a linear transition between them
+        //takes the right way around the colour wheel: The longer way if wrap_hue is set,
+        //the shorter one otherwise. Equal hues stay constant either way.
+        //Reduce results modulo HUE_RANGE
+        void hue_path(uint16_t start, uint16_t end, uint16_t& path_start, uint16_t& path_end) const{
+            int16_t difference = int16_t(end) - int16_t(start);
+            if(!wrap_hue){
+                if(difference > int16_t(HUE_RANGE / 2)) difference -= HUE_RANGE;
+                else if(difference < -int16_t(HUE_RANGE / 2)) difference += HUE_RANGE;
+            } else if(difference > 0 && difference < int16_t(HUE_RANGE / 2)){
+                difference -= HUE_RANGE;
+            } else if(difference < 0 && difference > -int16_t(HUE_RANGE / 2)){
+                difference += HUE_RANGE;
+            }
+            path_start = start + HUE_RANGE;
+            path_end = path_start + difference;
+        }
+
+        //Number of bytes a cue takes up when stored, see encode()
+        static const uint8_t STORED_SIZE = 23;
+
+        //Write cue to STORED_SIZE bytes, independent of how the compiler lays out Cue
+        void encode(uint8_t* bytes) const{
+            using namespace little_endian;
+            put16(bytes, channels | uint16_t(reverse) << 12 | uint16_t(wrap_hue) << 13 |
+                         uint16_t(blend_mode) << 14);
+            *bytes++ = time_divisor;
+            put16(bytes, delay);
+            put32(bytes, duration);
+            *bytes++ = static_cast<uint8_t>(ramp_type);
+            put32(bytes, ramp_parameter);
+            const Color* colors[3] = { &start_color, &end_color, &offset_color };
+            for(const Color* color : colors){
+                *bytes++ = color->R;
+                *bytes++ = color->G;
+                *bytes++ = color->B;
+            }
+        }
+
+        //Inverse of encode
+        static Cue decode(const uint8_t* bytes){
+            using namespace little_endian;
+            Cue cue;
+            uint16_t flags = get16(bytes);
+            cue.channels = flags & 0x0FFF;
+            cue.reverse = flags & (1 << 12);
+            cue.wrap_hue = flags & (1 << 13);
+            cue.blend_mode = static_cast<BlendMode>(flags >> 14);
+            cue.time_divisor = *bytes++;
+            cue.delay = get16(bytes);
+            cue.duration = get32(bytes);
+            cue.ramp_type = static_cast<RampType>(*bytes++);
+            cue.ramp_parameter = get32(bytes);
+            //Keep corrupted data from dividing by zero, like from_pb_cue
+            if(cue.time_divisor == 0) cue.time_divisor = 1;
+            if(cue.duration == 0) cue.duration = 1;
+            if(cue.ramp_parameter > cue.duration) cue.ramp_parameter = cue.duration;
+            Color* colors[3] = { &cue.start_color, &cue.end_color, &cue.offset_color };
+            for(Color* color : colors){
+                *color = { bytes[0], bytes[1], bytes[2] };
+                bytes += 3;
+            }
+            return cue;
         }
 
         // Return as protobuf-defined Cue
-        pb::Cue as_pb_cue(){
+        pb::Cue as_pb_cue() const{
             using namespace pb;
 
             pb::Cue pb_cue = Cue_init_default;
 
             pb_cue.channels = {};
             pb_cue.channels.funcs.encode = &encode_channels;
-            pb_cue.channels.arg = this;
+            //Only read by encode_channels
+            pb_cue.channels.arg = const_cast<Cue*>(this);
 
             pb_cue.reverse = this->reverse;
             pb_cue.wrap_hue = this->wrap_hue;
@@ -103,7 +188,46 @@ namespace iris{
             return pb_cue;
         }
 
+        // Prepare pb_cue for decoding, channels are decoded into channels
+        static void prepare_pb_cue(pb::Cue& pb_cue, uint16_t* channels){
+            using namespace pb;
+
+            pb_cue = Cue_init_default;
+            *channels = 0;
+            pb_cue.channels.funcs.decode = &decode_channels;
+            pb_cue.channels.arg = channels;
+        }
+
+        // Return cue decoded into pb_cue, see prepare_pb_cue.
+        // iris.proto has no ramp_parameter, ramps take up the whole duration.
+        // Fields wider in iris.proto than in Cue are clamped to the range of Cue
+        static Cue from_pb_cue(const pb::Cue& pb_cue, uint16_t channels){
+            Cue cue;
+            cue.channels = channels & 0x0FFF;
+            cue.reverse = pb_cue.reverse;
+            cue.wrap_hue = pb_cue.wrap_hue;
+            cue.time_divisor = pb_cue.time_divisor == 0 ? 1 : pb_cue.time_divisor > 0xFF ? 0xFF : pb_cue.time_divisor;
+            cue.delay = pb_cue.delay > 0xFFFF ? 0xFFFF : pb_cue.delay;
+            cue.duration = pb_cue.duration != 0 ? pb_cue.duration : 1;
+            cue.ramp_type = static_cast<RampType>(pb_cue.ramp_type);
+            cue.ramp_parameter = cue.duration;
+
+            cue.start_color = pb_color_to_color(pb_cue.start_color);
+            cue.end_color = pb_color_to_color(pb_cue.end_color);
+            cue.offset_color = pb_color_to_color(pb_cue.offset_color);
+            return cue;
+        }
+
         private:
+            //Return position of channel inside the effect at time
+            uint32_t phase(uint32_t time, uint8_t channel) const{
+                channel = reverse ? channel : 11 - channel;
+                time += ( duration / time_divisor ) * channel;
+
+                //effect will restart
+                return time % duration;
+            }
+
             //Calculate point on linear transition between two values
             //It is required that (time <= duration)
             uint32_t linear_transition(uint32_t start, uint32_t end, uint32_t time){
@@ -137,54 +261,381 @@ namespace iris{
                 }
                 return true;
             }
+
+            // Decode channels from input stream, packed or not.
+            // The upper four bits of the result count the channels decoded so far
+            static bool decode_channels(pb_istream_t* stream,
+                                 const pb_field_t*,
+                                 void** arg){
+                uint16_t* channels = static_cast<uint16_t*>(*arg);
+                while(stream->bytes_left){
+                    uint64_t value;
+                    if(!pb_decode_varint(stream, &value))
+                        return false;
+                    uint8_t channel = *channels >> 12;
+                    if(channel < 12){
+                        if(value) bitSet(*channels, channel);
+                        *channels += 1 << 12;
+                    }
+                }
+                return true;
+            }
     };
 
-    //Storage for cues
+    //Precomputed values that allow evaluating a Cue on all channels without divisions.
+    //Results of linear ramps may be off by one compared to Cue::interpolate for
+    //ramps longer than about 3 seconds
+    struct RenderPlan{
+        //Fixed point position of linear ramp slopes. Hue needs a lower
+        //precision as it spans a larger range
+        static const uint8_t SLOPE_SHIFT = 23;
+        static const uint8_t HUE_SLOPE_SHIFT = 20;
+
+        //Phase difference between two neighbouring channels
+        uint32_t channel_step;
+        //Phase difference of channel 0 to the start of the effect
+        uint32_t first_offset;
+        //Number of channels after which their phases repeat, because time_divisor
+        //channel steps add up to exactly one duration. 0 if they never repeat
+        uint8_t phase_period;
+
+        //Start and end values of linear ramps, per component of RGB or HSL
+        uint16_t ramp_start[3];
+        uint16_t ramp_end[3];
+        //Slopes of rising and falling part of linear ramps, per component
+        uint32_t rise_slope[3];
+        uint32_t fall_slope[3];
+
+        //Last time passed to phase_at and the resulting phase
+        uint32_t last_time;
+        uint32_t last_phase;
+
+        //Plan of a default cue, only used to fill unused storage
+        RenderPlan() : RenderPlan(Cue()){}
+
+        RenderPlan(const Cue& cue) :
+            channel_step(cue.duration / cue.time_divisor),
+            first_offset(cue.reverse ? 0 : (channel_step * 11) % cue.duration),
+            phase_period(channel_step == 0 ? 1 : channel_step * cue.time_divisor == cue.duration ? cue.time_divisor : 0),
+            last_time(0),
+            last_phase(0)
+        {
+            if(cue.ramp_type == RampType::linearHSL){
+                HSL start = rgb_to_hsl(cue.start_color);
+                HSL end = rgb_to_hsl(cue.end_color);
+                cue.hue_path(start.H, end.H, ramp_start[0], ramp_end[0]);
+                ramp_start[1] = start.S; ramp_end[1] = end.S;
+                ramp_start[2] = start.L; ramp_end[2] = end.L;
+            } else {
+                ramp_start[0] = cue.start_color.R; ramp_end[0] = cue.end_color.R;
+                ramp_start[1] = cue.start_color.G; ramp_end[1] = cue.end_color.G;
+                ramp_start[2] = cue.start_color.B; ramp_end[2] = cue.end_color.B;
+            }
+
+            uint32_t fall_duration = cue.duration - cue.ramp_parameter;
+            for(uint8_t i = 0; i < 3; i++){
+                uint16_t delta = ramp_start[i] < ramp_end[i] ? ramp_end[i] - ramp_start[i] : ramp_start[i] - ramp_end[i];
+                rise_slope[i] = slope(delta, cue.ramp_parameter, shift(cue, i));
+                fall_slope[i] = slope(delta, fall_duration, shift(cue, i));
+            }
+        }
+
+        //Return position inside the effect at time, equal to time % cue.duration.
+        //Only divides when time moved backwards or by more than a whole duration
+        uint32_t phase_at(const Cue& cue, uint32_t time){
+            uint32_t elapsed = time - last_time;
+            if(time >= last_time && elapsed < cue.duration){
+                last_phase += elapsed;
+                if(last_phase >= cue.duration) last_phase -= cue.duration;
+            } else {
+                last_phase = time % cue.duration;
+            }
+            last_time = time;
+            return last_phase;
+        }
+
+        //Return position of a channel inside the effect,
+        //offset starts as first_offset and is advanced by next_offset
+        uint32_t channel_phase(const Cue& cue, uint32_t phase, uint32_t offset) const{
+            //Both are smaller than duration, so one subtraction is enough
+            phase += offset;
+            return phase >= cue.duration ? phase - cue.duration : phase;
+        }
+
+        //Advance offset from one channel to the next
+        void next_offset(const Cue& cue, uint32_t& offset) const{
+            if(cue.reverse){
+                offset += channel_step;
+                if(offset >= cue.duration) offset -= cue.duration;
+            } else {
+                offset = offset >= channel_step ? offset - channel_step : offset + cue.duration - channel_step;
+            }
+        }
+
+        //Return colour at a position inside the effect
+        Color evaluate(const Cue& cue, uint32_t phase) const{
+            switch(cue.ramp_type){
+                case RampType::jump:
+                    return phase > cue.ramp_parameter ? cue.end_color : cue.start_color;
+                case RampType::linearHSL:{
+                    HSL hsl;
+                    hsl.H = linear_transition(cue, 0, phase);
+                    while(hsl.H >= HUE_RANGE) hsl.H -= HUE_RANGE;
+                    hsl.S = linear_transition(cue, 1, phase);
+                    hsl.L = linear_transition(cue, 2, phase);
+                    return hsl_to_rgb(hsl);
+                }
+                case RampType::linearRGB:{
+                    Color result;
+                    result.R = linear_transition(cue, 0, phase);
+                    result.G = linear_transition(cue, 1, phase);
+                    result.B = linear_transition(cue, 2, phase);
+                    return result;
+                }
+            }
+            return {0, 0, 0};
+        }
+
+        //Return for how many ms starting at a position inside the effect
+        //the result of evaluate will stay the same. Returns UINT32_MAX if it never changes
+        uint32_t stable_at_phase(const Cue& cue, uint32_t phase) const{
+            switch(cue.ramp_type){
+                case RampType::jump:
+                    if(cue.start_color.R == cue.end_color.R &&
+                       cue.start_color.G == cue.end_color.G &&
+                       cue.start_color.B == cue.end_color.B){
+                        return UINT32_MAX;
+                    }
+                    if(phase > cue.ramp_parameter){
+                        //end_color until the effect restarts
+                        return cue.duration - phase;
+                    }
+                    if(cue.ramp_parameter + 1 >= cue.duration){
+                        //end_color is never reached
+                        return UINT32_MAX;
+                    }
+                    return cue.ramp_parameter + 1 - phase;
+                case RampType::linearHSL:
+                case RampType::linearRGB:{
+                    //The colour can't change as long as none of the components do
+                    uint32_t result = UINT32_MAX;
+                    for(uint8_t i = 0; i < 3; i++){
+                        if(ramp_start[i] == ramp_end[i]) continue;
+                        uint32_t change = next_change(cue, i, phase);
+                        if(change - phase < result) result = change - phase;
+                    }
+                    return result;
+                }
+            }
+            return 0;
+        }
+
+        private:
+            //Return the next position after phase at which linear_transition
+            //of a component returns a different value
+            uint32_t next_change(const Cue& cue, uint8_t component, uint32_t phase) const{
+                uint8_t slope_shift = shift(cue, component);
+                if(phase < cue.ramp_parameter){
+                    uint32_t rise = rise_slope[component];
+                    uint32_t steps = ((rise * phase) >> slope_shift) + 1;
+                    uint32_t change = phase + 1;
+                    if(rise != 0){
+                        uint32_t scaled = steps << slope_shift;
+                        change = scaled / rise + (scaled % rise != 0);
+                    }
+                    return change < cue.ramp_parameter ? change : cue.ramp_parameter;
+                }
+
+                uint32_t fall = fall_slope[component];
+                if(fall == 0) return cue.duration;
+                uint32_t steps = ((fall * (phase - cue.ramp_parameter)) >> slope_shift) + 1;
+                uint32_t scaled = steps << slope_shift;
+                uint32_t change = cue.ramp_parameter + scaled / fall + (scaled % fall != 0);
+                return change < cue.duration ? change : cue.duration;
+            }
+
+            //Return fixed point position of the slopes of a component
+            static uint8_t shift(const Cue& cue, uint8_t component){
+                return cue.ramp_type == RampType::linearHSL && component == 0 ?
+                    HUE_SLOPE_SHIFT : SLOPE_SHIFT;
+            }
+
+            //Fixed point slope for a change by delta over duration, rounded up
+            static uint32_t slope(uint32_t delta, uint32_t duration, uint8_t shift){
+                if(duration == 0) return 0;
+                uint32_t scaled_delta = delta << shift;
+                uint32_t result = scaled_delta / duration;
+                return result * duration == scaled_delta ? result : result + 1;
+            }
+
+            //Same as Cue::linear_transition, using the precomputed slopes
+            uint16_t linear_transition(const Cue& cue, uint8_t component, uint32_t phase) const{
+                uint16_t start = ramp_start[component];
+                uint16_t end = ramp_end[component];
+                uint8_t slope_shift = shift(cue, component);
+
+                uint16_t summand;
+                if(phase < cue.ramp_parameter){
+                    summand = (rise_slope[component] * phase) >> slope_shift;
+                } else {
+                    uint16_t delta = start < end ? end - start : start - end;
+                    summand = delta - ((fall_slope[component] * (phase - cue.ramp_parameter)) >> slope_shift);
+                }
+                return start < end ? start + summand : start - summand;
+            }
+    };
+
+    //Maximum number of cues that can be pushed, each takes up
+    //sizeof(Cue) + sizeof(RenderPlan) bytes of RAM whether it is used or not.
+    //Mounted cues don't count towards this
+    #ifndef IRIS_MAX_CUES
+    #define IRIS_MAX_CUES 4
+    #endif
+
+    //Storage for cues. The first cues can be used directly from a medium
+    //they are stored on, see mount(). Pushed cues are stored in RAM after them
     namespace Cues{
+        //Number of mounted cues kept in RAM at once, along with their render plans
+        const uint8_t CACHE_SIZE = 4;
+
+        //Number of times a mounted cue had to be read from its medium
+        uint16_t cache_misses = 0;
+
         namespace{
             //Storage for all cues currently loaded
-            std::vector<Cue> loaded_cues;
-        }
+            arena_t<Cue, IRIS_MAX_CUES> loaded_cues;
+            //Render plan for each cue in loaded_cues
+            arena_t<RenderPlan, IRIS_MAX_CUES> render_plans;
+
+            //Changed whenever cues are loaded or unloaded,
+            //allows caches of cue results to detect they are outdated
+            uint8_t current_revision = 0;
 
-        //Return const iterator to begin of Cue storage
-        static std::vector<Cue>::const_iterator begin(){
-            return loaded_cues.begin();
+            //Mounted cues are stored one after another starting at mounted_address
+            medium_t mounted_medium;
+            uint16_t mounted_address = 0;
+            uint16_t mounted_count = 0;
+
+            const uint16_t UNCACHED = 0xFFFF;
+
+            struct cache_slot_t{
+                uint16_t cue_id;
+                //Value of cache_clock when the slot was last used
+                uint8_t last_used;
+                Cue cue;
+                RenderPlan plan;
+
+                cache_slot_t() : cue_id(UNCACHED), last_used(0), cue(), plan(cue){}
+            };
+
+            cache_slot_t cache[CACHE_SIZE];
+            uint8_t cache_clock = 0;
+
+            //Return cache slot holding the mounted cue with ID cue_id,
+            //replacing the least recently used one if it isn't cached
+            cache_slot_t& cached(uint16_t cue_id){
+                ++cache_clock;
+                cache_slot_t* oldest = &cache[0];
+                for(cache_slot_t& slot : cache){
+                    if(slot.cue_id == cue_id){
+                        slot.last_used = cache_clock;
+                        return slot;
+                    }
+                    if(uint8_t(cache_clock - slot.last_used) > uint8_t(cache_clock - oldest->last_used)){
+                        oldest = &slot;
+                    }
+                }
+
+                uint8_t bytes[Cue::STORED_SIZE];
+                mounted_medium.read(mounted_address + cue_id * Cue::STORED_SIZE, bytes, sizeof(bytes));
+                oldest->cue = Cue::decode(bytes);
+                oldest->plan = RenderPlan(oldest->cue);
+                oldest->cue_id = cue_id;
+                oldest->last_used = cache_clock;
+                ++cache_misses;
+                return *oldest;
+            }
         }
 
-        //Return const iterator to end of Cue storage
-        static std::vector<Cue>::const_iterator end(){
-            return loaded_cues.end();
+        //Load a cue. Returns false if there is no room for it
+        static bool push(const Cue& cue){
+            if(!loaded_cues.push_back(cue)) return false;
+            render_plans.push_back(RenderPlan(cue));
+            ++current_revision;
+            return true;
         }
 
-        //Load a cue
-        static void push(const Cue& cue){
-            loaded_cues.push_back(cue);
+        //Return number of cues that can still be pushed
+        static size_t free_slots(){
+            return loaded_cues.capacity() - loaded_cues.size();
         }
 
         //Unload all cues
         static void clear(){
             loaded_cues.clear();
+            render_plans.clear();
+            mounted_count = 0;
+            for(cache_slot_t& slot : cache){
+                slot.cue_id = UNCACHED;
+            }
+            ++current_revision;
+        }
+
+        //Unload all cues and use count cues stored from address on medium instead,
+        //each encoded with Cue::encode. The medium must not change while mounted
+        static void mount(const medium_t& medium, uint16_t address, uint16_t count){
+            clear();
+            mounted_medium = medium;
+            mounted_address = address;
+            mounted_count = count;
+        }
+
+        //Return current revision, see above
+        static uint8_t revision(){
+            return current_revision;
+        }
+
+        //Return reference to cue with ID cue_id.
+        //For mounted cues, it is only valid until another cue is accessed
+        static const Cue& get(size_t cue_id){
+            if(cue_id < mounted_count) return cached(cue_id).cue;
+            return loaded_cues[cue_id - mounted_count];
+        }
+
+        //Return cue with ID cue_id like get(), but without replacing a cached cue,
+        //so the cues drawn stay cached while all of them are read, e.g. to store them
+        static Cue peek(size_t cue_id){
+            if(cue_id >= mounted_count) return loaded_cues[cue_id - mounted_count];
+            for(const cache_slot_t& slot : cache){
+                if(slot.cue_id == cue_id) return slot.cue;
+            }
+            uint8_t bytes[Cue::STORED_SIZE];
+            mounted_medium.read(mounted_address + cue_id * Cue::STORED_SIZE, bytes, sizeof(bytes));
+            return Cue::decode(bytes);
         }
 
-        //Return reference to cue with ID cue_id
-        static Cue& get(size_t cue_id){
-            return loaded_cues[cue_id];
+        //Return render plan of cue with ID cue_id, valid as long as the result of get
+        static RenderPlan& plan(size_t cue_id){
+            if(cue_id < mounted_count) return cached(cue_id).plan;
+            return render_plans[cue_id - mounted_count];
         }
 
         //Return number of loaded cues
         static size_t count(){
-            return loaded_cues.size();
+            return mounted_count + loaded_cues.size();
         }
 
-        //Calculate size of actual information stored for schedules
+        //Calculate size of actual information stored for cues in RAM
         static size_t size_in_bytes(){
-            return loaded_cues.size() *
-                    sizeof(decltype(loaded_cues)::value_type);
+            return loaded_cues.size_in_bytes();
         }
 
-        //Calculate overhead in bytes of schedules when stored in memory
+        //Calculate overhead in bytes of cues when stored in memory,
+        //including storage reserved for cues that haven't been pushed
         static size_t memory_overhead(){
-            return sizeof(loaded_cues);
+            return loaded_cues.memory_overhead() +
+                    sizeof(render_plans) +
+                    sizeof(cache);
         }
     }
 }
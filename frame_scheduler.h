@@ -0,0 +1,142 @@
+//Timing of the main loop, frames are rendered on a fixed grid of deadlines
+#pragma once
+
+#include <stdint.h>
+#include "Arduino.h"
+
+#include "serial_text.h"
+
+namespace freilite{
+namespace iris{
+namespace frame_scheduler{
+    //Default time between two frames in ms
+    const uint16_t DEFAULT_FRAME_PERIOD = 20;
+    //Frames starting later than this many us after their deadline count as late
+    const uint16_t LATE_TOLERANCE = 1000;
+
+    //Statistics, reset by reset_stats()
+    uint16_t frames = 0;
+    //Frames that started more than LATE_TOLERANCE after their deadline
+    uint16_t late_frames = 0;
+    //Frames that were dropped because a previous frame was more than one period late
+    uint16_t skipped_frames = 0;
+    //Time between deadline and actual start of a frame in us
+    uint32_t max_jitter = 0;
+    uint32_t total_jitter = 0;
+    //Time in us spent rendering frames and waiting for the next frame
+    uint32_t busy_time = 0;
+    uint32_t idle_time = 0;
+
+    namespace {
+        //Time between two frames in us
+        uint32_t frame_period = DEFAULT_FRAME_PERIOD * 1000UL;
+        //Time in us at which the next frame should start
+        uint32_t next_deadline = 0;
+        //The same in ms, as micros() overflows after about 70 minutes
+        uint32_t next_frame_time = 0;
+        //Number of periods frames become due before their deadline, see render_ahead()
+        uint8_t frames_ahead = 0;
+        //Start of the frame currently being rendered, or of the idle period after it
+        uint32_t phase_start = 0;
+        bool rendering = false;
+
+        //Overflow-safe comparison of two timestamps from micros()
+        inline bool reached(uint32_t now, uint32_t deadline){
+            return static_cast<int32_t>(now - deadline) >= 0;
+        }
+    }
+
+    void reset_stats(){
+        frames = 0;
+        late_frames = 0;
+        skipped_frames = 0;
+        max_jitter = 0;
+        total_jitter = 0;
+        busy_time = 0;
+        idle_time = 0;
+    }
+
+    //Start scheduling frames period_ms apart, the first one is due immediately
+    void begin(uint16_t period_ms = DEFAULT_FRAME_PERIOD){
+        frame_period = period_ms * 1000UL;
+        next_deadline = micros();
+        next_frame_time = millis();
+        phase_start = next_deadline;
+        rendering = false;
+        reset_stats();
+    }
+
+    //Return time between two frames in ms
+    uint16_t period(){
+        return frame_period / 1000;
+    }
+
+    //Let frames become due up to frames periods before their deadline, so they can be
+    //rendered while the CPU is idle and queued for display. Their frame_time() stays the deadline
+    void render_ahead(uint8_t frames){
+        frames_ahead = frames;
+    }
+
+    //Return true if the next frame is due and should be rendered now.
+    //Everything between the return of false and the next frame
+    //counts as idle time, so this should be polled in the slack of each frame
+    bool frame_due(){
+        uint32_t now = micros();
+        if(!reached(now + frames_ahead * frame_period, next_deadline)) return false;
+
+        idle_time += now - phase_start;
+        phase_start = now;
+        rendering = true;
+
+        //Frames rendered ahead of their deadline aren't late at all
+        uint32_t lateness = reached(now, next_deadline) ? now - next_deadline : 0;
+        if(lateness > LATE_TOLERANCE) ++late_frames;
+        if(lateness > max_jitter) max_jitter = lateness;
+        total_jitter += lateness;
+
+        //Skip frames whose deadline has passed entirely, the frame rendered now
+        //is the last one that was due
+        if(lateness >= frame_period){
+            uint32_t missed = lateness / frame_period;
+            skipped_frames += missed;
+            next_deadline += missed * frame_period;
+            next_frame_time += missed * period();
+        }
+
+        return true;
+    }
+
+    //Return the time in ms the frame that is due should show.
+    //This is its deadline, not the current time, so animations advance evenly
+    uint32_t frame_time(){
+        return next_frame_time;
+    }
+
+    //Call after a frame that was due has been rendered
+    void frame_done(){
+        if(!rendering) return;
+
+        uint32_t now = micros();
+        busy_time += now - phase_start;
+        phase_start = now;
+        rendering = false;
+
+        ++frames;
+        next_deadline += frame_period;
+        next_frame_time += period();
+    }
+
+    //Write timing statistics to SerialUSB connection
+    void print_stats(){
+        communication::printf(
+            F("Frames: %u, late: %u, skipped: %u\n"
+              "Jitter: avg %lu us, max %lu us\n"
+              "Busy: %lu us, idle: %lu us\n"),
+            frames, late_frames, skipped_frames,
+            (unsigned long)(frames ? total_jitter / frames : 0), (unsigned long)max_jitter,
+            (unsigned long)busy_time, (unsigned long)idle_time
+        );
+    }
+}
+}
+}
@@ -0,0 +1,111 @@
+//Host stand-in for the Arduino core, backed by the simulator in avr_sim.h
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <deque>
+#include <vector>
+
+#include "avr_sim.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+//Program memory is ordinary memory on the host
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(address) (*reinterpret_cast<const uint8_t*>(address))
+#define pgm_read_word(address) (*reinterpret_cast<const uint16_t*>(address))
+#define pgm_read_dword(address) (*reinterpret_cast<const uint32_t*>(address))
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define vsnprintf_P vsnprintf
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(PSTR(string_literal)))
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+//Registers
+sim::register8_t<sim::IO_ACCESS_CYCLES, true> PORTB = {0};
+sim::register8_t<sim::IO_ACCESS_CYCLES, true> DDRB = {0};
+sim::register8_t<sim::EXT_ACCESS_CYCLES> TCCR1A = {0};
+sim::tccr1b_t TCCR1B;
+sim::register8_t<sim::EXT_ACCESS_CYCLES> TCCR1C = {0};
+sim::timsk1_t TIMSK1 = {0};
+sim::tcnt1_t TCNT1;
+sim::ocr1a_t OCR1A;
+#define SREG (sim::sreg)
+#define OCIE1A 1
+
+#define ISR(vector) void vector()
+
+inline void cli(){ sim::sreg = sim::sreg.value & ~0x80; }
+inline void sei(){ sim::sreg = sim::sreg.value | 0x80; }
+
+inline void _delay_loop_2(uint16_t iterations){
+    sim::delay_loop_2(iterations);
+}
+
+//Time is derived from the simulated clock instead of Timer0
+inline unsigned long millis(){
+    return sim::cycles / (sim::CPU_FREQUENCY / 1000);
+}
+
+inline unsigned long micros(){
+    return sim::cycles / (sim::CPU_FREQUENCY / 1000000);
+}
+
+inline void delay(unsigned long ms){
+    sim::run_for(uint64_t(ms) * (sim::CPU_FREQUENCY / 1000));
+}
+
+inline void delayMicroseconds(unsigned int us){
+    sim::run_for(uint64_t(us) * (sim::CPU_FREQUENCY / 1000000));
+}
+
+//USB CDC connection. Bytes sent by the "host computer" are queued into rx,
+//everything the firmware writes ends up in tx
+class SerialUSB_t{
+    public:
+        std::deque<uint8_t> rx;
+        std::vector<uint8_t> tx;
+        //Bytes that can be written without blocking, like the free space in the USB endpoint
+        int write_space = 64;
+
+        void begin(unsigned long){}
+
+        int available(){
+            return rx.size();
+        }
+
+        int read(){
+            if(rx.empty()) return -1;
+            uint8_t value = rx.front();
+            rx.pop_front();
+            return value;
+        }
+
+        int availableForWrite(){
+            return write_space;
+        }
+
+        size_t write(uint8_t value){
+            tx.push_back(value);
+            return 1;
+        }
+
+        size_t write(const uint8_t* buffer, size_t size){
+            tx.insert(tx.end(), buffer, buffer + size);
+            return size;
+        }
+};
+
+SerialUSB_t SerialUSB;
@@ -0,0 +1,8 @@
+//Host stand-in for ArduinoSTL, the native standard library takes its place
+#pragma once
+
+#include <cstdio>
+#include <cstdarg>
+#include <string>
+#include <vector>
+#include <algorithm>
@@ -0,0 +1,108 @@
+//Host stand-in for the Arduino EEPROM library, same interface as the AVR version
+#pragma once
+
+#include <stdint.h>
+
+#include "Arduino.h"
+
+namespace sim{
+    const uint16_t EEPROM_SIZE = 1024;
+    //A write takes about 3.3 ms in the background. Accessing the EEPROM
+    //before it is finished waits for it, like avr-libc does
+    const uint32_t EEPROM_WRITE_CYCLES = CPU_FREQUENCY / 1000 * 33 / 10;
+
+    //Starts out erased, like a new part
+    uint8_t eeprom[EEPROM_SIZE];
+    struct eeprom_eraser_t{
+        eeprom_eraser_t(){ memset(eeprom, 0xFF, EEPROM_SIZE); }
+    } eeprom_eraser;
+
+    //Accounting
+    uint32_t eeprom_reads = 0;
+    uint32_t eeprom_writes = 0;
+
+    //Cycle count at which the write in progress is finished
+    uint64_t eeprom_ready_at = 0;
+
+    bool eeprom_ready(){
+        return cycles >= eeprom_ready_at;
+    }
+
+    //Interrupts keep running while waiting
+    void eeprom_wait(){
+        if(!eeprom_ready()) run_until(eeprom_ready_at);
+    }
+
+    uint8_t eeprom_read(int index){
+        eeprom_wait();
+        ++eeprom_reads;
+        return eeprom[index];
+    }
+
+    void eeprom_write(int index, uint8_t value){
+        eeprom_wait();
+        ++eeprom_writes;
+        eeprom[index] = value;
+        eeprom_ready_at = cycles + EEPROM_WRITE_CYCLES;
+    }
+}
+
+//From avr/eeprom.h: true if no write is in progress, reads EECR
+inline bool eeprom_is_ready(){
+    sim::charge(sim::IO_ACCESS_CYCLES);
+    return sim::eeprom_ready();
+}
+
+//From avr/eeprom.h: wait until no write is in progress
+inline void eeprom_busy_wait(){
+    sim::eeprom_wait();
+}
+
+struct EERef{
+    int index;
+
+    EERef(const int index) : index(index){}
+
+    uint8_t operator*() const{ return sim::eeprom_read(index); }
+    operator uint8_t() const{ return **this; }
+
+    EERef& operator=(const EERef& ref){ return *this = *ref; }
+    EERef& operator=(uint8_t value){
+        sim::eeprom_write(index, value);
+        return *this;
+    }
+
+    EERef& update(uint8_t value){
+        return value != **this ? *this = value : *this;
+    }
+};
+
+struct EEPtr{
+    int index;
+
+    EEPtr(const int index) : index(index){}
+
+    operator int() const{ return index; }
+    EEPtr& operator=(int value){ index = value; return *this; }
+
+    bool operator!=(const EEPtr& ptr){ return index != ptr.index; }
+    EERef operator*(){ return index; }
+
+    EEPtr& operator++(){ ++index; return *this; }
+    EEPtr& operator--(){ --index; return *this; }
+    EEPtr operator++(int){ return index++; }
+    EEPtr operator--(int){ return index--; }
+};
+
+struct EEPROMClass{
+    EERef operator[](const int index){ return index; }
+    uint8_t read(int index){ return EERef(index); }
+    void write(int index, uint8_t value){ (EERef(index)) = value; }
+    void update(int index, uint8_t value){ EERef(index).update(value); }
+
+    EEPtr begin(){ return 0x00; }
+    EEPtr end(){ return length(); }
+    uint16_t length(){ return sim::EEPROM_SIZE; }
+};
+
+static EEPROMClass EEPROM;
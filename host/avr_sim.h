@@ -0,0 +1,242 @@
+//Cycle-accounting stand-in for the parts of the ATmega32U4 used by the firmware
+//
+//The firmware headers don't know they are running on a PC: every special function
+//register they touch is replaced by an object of the types defined here. Each access
+//charges the amount of cycles the real instruction would take to a global cycle
+//counter, which in turn drives Timer1 and fires TIMER1_COMPA_vect at the right time.
+//
+//Only register accesses, busy loops and interrupt entry/exit are charged. Plain
+//arithmetic and SRAM accesses of the firmware are not, so all cycle figures are a
+//lower bound. They are accurate enough to compare two versions of the display path.
+#pragma once
+
+#include <stdint.h>
+
+namespace sim{
+    const uint32_t CPU_FREQUENCY = 16000000;
+
+    //Cost model, in clock cycles
+    const uint8_t IO_ACCESS_CYCLES = 1;   //in/out for registers in the lower I/O space
+    const uint8_t EXT_ACCESS_CYCLES = 2;  //lds/sts for extended I/O registers, per byte
+    const uint8_t ISR_ENTRY_CYCLES = 5 + 3 + 2 * 13; //response, jmp and prologue pushes
+    const uint8_t ISR_EXIT_CYCLES = 2 * 13 + 5;      //epilogue pops and reti
+    const uint8_t DELAY_LOOP_2_CYCLES = 4;           //per iteration of _delay_loop_2
+
+    //Global clock
+    uint64_t cycles = 0;
+
+    //Accounting
+    bool in_isr = false;
+    uint64_t isr_count = 0;
+    uint64_t isr_cycles = 0;        //all cycles spent inside interrupt handlers
+    uint64_t busy_wait_cycles = 0;  //part of isr_cycles spent in busy loops
+
+    void charge(uint32_t amount){
+        cycles += amount;
+        if(in_isr) isr_cycles += amount;
+    }
+
+    //Clear all accounting, but leave the clock running
+    void reset_accounting(){
+        isr_count = 0;
+        isr_cycles = 0;
+        busy_wait_cycles = 0;
+    }
+
+    //Called after each write to one of the port registers, used for observing the display
+    void (*port_write_hook)() = nullptr;
+
+    //8 bit register with a fixed access cost
+    template<uint8_t access_cycles, bool observed = false>
+    struct register8_t{
+        uint8_t value;
+
+        operator uint8_t() const{
+            charge(access_cycles);
+            return value;
+        }
+
+        template<typename T>
+        register8_t& operator=(T new_value){
+            charge(access_cycles);
+            value = static_cast<uint8_t>(new_value);
+            if(observed && port_write_hook) port_write_hook();
+            return *this;
+        }
+
+        template<typename T> register8_t& operator&=(T mask){ return *this = uint8_t(*this) & mask; }
+        template<typename T> register8_t& operator|=(T mask){ return *this = uint8_t(*this) | mask; }
+    };
+
+    //Timer/Counter1 in normal mode with output compare unit A
+    namespace timer1{
+        //Reading TCNT1 with prescaler 0 yields the frozen count
+        uint16_t frozen_count = 0;
+        //Cycle at which TCNT1 was (virtually) zero
+        uint64_t base = 0;
+        uint16_t compare_a = 0;
+        uint8_t clock_select = 0;
+        bool interrupt_enabled = false;
+        bool compare_a_pending = false;
+        //Cycle up to which compare matches have been checked for
+        uint64_t settled = 0;
+
+        void (*compare_a_vector)() = nullptr;
+
+        uint32_t prescaler(){
+            static const uint16_t FACTORS[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+            return FACTORS[clock_select & 0x07];
+        }
+
+        uint16_t count(){
+            if(!prescaler()) return frozen_count;
+            return static_cast<uint16_t>((cycles - base) / prescaler());
+        }
+
+        //Cycle of the first compare match after cycle "after"
+        uint64_t next_match(uint64_t after){
+            const uint64_t period = 65536ull * prescaler();
+            uint64_t match = base + uint64_t(compare_a) * prescaler();
+            if(match <= after){
+                match += ((after - match) / period + 1) * period;
+            }
+            return match;
+        }
+
+        //Raise the interrupt flag if a compare match happened since the last call
+        void settle(){
+            if(prescaler() && next_match(settled) <= cycles){
+                compare_a_pending = true;
+            }
+            settled = cycles;
+        }
+
+        void set_count(uint16_t value){
+            settle();
+            frozen_count = value;
+            base = cycles - uint64_t(value) * prescaler();
+        }
+
+        void set_compare_a(uint16_t value){
+            settle();
+            compare_a = value;
+        }
+
+        void set_clock_select(uint8_t value){
+            uint16_t current = count();
+            settle();
+            clock_select = value & 0x07;
+            set_count(current);
+        }
+    }
+
+    //16 bit timer registers, forwarded to the timer model
+    struct tcnt1_t{
+        operator uint16_t() const{
+            charge(2 * EXT_ACCESS_CYCLES);
+            return timer1::count();
+        }
+        tcnt1_t& operator=(uint16_t value){
+            charge(2 * EXT_ACCESS_CYCLES);
+            timer1::set_count(value);
+            return *this;
+        }
+    };
+
+    struct ocr1a_t{
+        operator uint16_t() const{
+            charge(2 * EXT_ACCESS_CYCLES);
+            return timer1::compare_a;
+        }
+        ocr1a_t& operator=(uint16_t value){
+            charge(2 * EXT_ACCESS_CYCLES);
+            timer1::set_compare_a(value);
+            return *this;
+        }
+    };
+
+    struct tccr1b_t{
+        operator uint8_t() const{
+            charge(EXT_ACCESS_CYCLES);
+            return timer1::clock_select;
+        }
+        template<typename T>
+        tccr1b_t& operator=(T value){
+            charge(EXT_ACCESS_CYCLES);
+            timer1::set_clock_select(static_cast<uint8_t>(value));
+            return *this;
+        }
+        template<typename T> tccr1b_t& operator&=(T mask){ return *this = uint8_t(*this) & mask; }
+        template<typename T> tccr1b_t& operator|=(T mask){ return *this = uint8_t(*this) | mask; }
+    };
+
+    struct timsk1_t{
+        uint8_t value;
+        operator uint8_t() const{
+            charge(EXT_ACCESS_CYCLES);
+            return value;
+        }
+        template<typename T>
+        timsk1_t& operator=(T new_value){
+            charge(EXT_ACCESS_CYCLES);
+            value = static_cast<uint8_t>(new_value);
+            timer1::settle();
+            timer1::interrupt_enabled = value & (1 << 1);
+            return *this;
+        }
+        template<typename T> timsk1_t& operator&=(T mask){ return *this = uint8_t(*this) & mask; }
+        template<typename T> timsk1_t& operator|=(T mask){ return *this = uint8_t(*this) | mask; }
+    };
+
+    //Status register, only the global interrupt flag is modelled
+    register8_t<IO_ACCESS_CYCLES> sreg = {0x80};
+
+    bool interrupts_enabled(){
+        return sreg.value & 0x80;
+    }
+
+    //Execute the compare match interrupt like the hardware would
+    void fire_compare_a(){
+        timer1::compare_a_pending = false;
+        ++isr_count;
+        in_isr = true;
+        uint8_t saved_sreg = sreg.value;
+        sreg.value &= ~0x80;
+        charge(ISR_ENTRY_CYCLES);
+        if(timer1::compare_a_vector) timer1::compare_a_vector();
+        charge(ISR_EXIT_CYCLES);
+        sreg.value = saved_sreg | 0x80;
+        in_isr = false;
+        timer1::settle();
+    }
+
+    //Let the main program idle until the clock reaches cycle "end",
+    //executing all interrupts that occur in the meantime
+    void run_until(uint64_t end){
+        while(true){
+            timer1::settle();
+            bool can_fire = timer1::interrupt_enabled && interrupts_enabled() && !in_isr;
+            if(can_fire && timer1::compare_a_pending){
+                fire_compare_a();
+                continue;
+            }
+            if(!can_fire || !timer1::prescaler()) break;
+
+            uint64_t match = timer1::next_match(timer1::settled);
+            if(match > end) break;
+            cycles = match;
+        }
+        if(cycles < end) cycles = end;
+    }
+
+    void run_for(uint64_t amount){
+        run_until(cycles + amount);
+    }
+
+    //Busy loop as implemented in <util/delay_basic.h>
+    void delay_loop_2(uint16_t iterations){
+        uint32_t amount = uint32_t(iterations ? iterations : 65536) * DELAY_LOOP_2_CYCLES;
+        charge(amount);
+        if(in_isr) busy_wait_cycles += amount;
+    }
+}
@@ -0,0 +1,1634 @@
+//Benchmarks for the display path, running the firmware on the simulator in avr_sim.h
+//Build and run with `make bench` from the repository root. It exits with a non-zero
+//status if any check fails, which `make check` relies on
+#include <chrono>
+#include <cmath>
+#include <new>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+#include "../bcm_data_direction.ino"
+
+//Count heap allocations, the firmware shouldn't make any after startup
+namespace{
+    uint32_t heap_allocations = 0;
+}
+
+void* operator new(size_t size){
+    ++heap_allocations;
+    if(void* pointer = malloc(size)) return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept{
+    free(pointer);
+}
+
+using namespace freilite;
+using namespace freilite::iris;
+
+namespace{
+    //Same show as the one set up in bcm_data_direction.ino
+    void load_demo_configuration(){
+        Cues::clear();
+        Schedules::clear();
+
+        Cue new_cue = Cue();
+        new_cue.ramp_type = RampType::linearRGB;
+        new_cue.start_color = {255, 255, 255};
+        new_cue.end_color = {0, 0, 0};
+        Cues::push(new_cue);
+        Schedules::push_element(delay_t(delimiter_flag_t::schedule, 0));
+
+        new_cue = Cue();
+        new_cue.duration = 500;
+        new_cue.ramp_parameter = 250;
+        new_cue.ramp_type = RampType::jump;
+        new_cue.time_divisor = 6;
+        new_cue.reverse = true;
+        new_cue.start_color = {255, 50, 0};
+        new_cue.end_color = {0, 50, 255};
+        Cues::push(new_cue);
+        Schedules::push_element(delay_t(delimiter_flag_t::schedule, 1));
+
+        new_cue = Cue();
+        new_cue.duration = 2000;
+        new_cue.ramp_parameter = 1000;
+        new_cue.ramp_type = RampType::linearRGB;
+        new_cue.start_color = {0x00, 0xF3, 0xF3};
+        new_cue.end_color = {0xEE, 0xF3, 0x00};
+        Cues::push(new_cue);
+        Schedules::push_element(delay_t(delimiter_flag_t::schedule, 2));
+    }
+
+    //Number of checks that failed, main() returns non-zero if there were any
+    uint32_t failed_checks = 0;
+
+    //Count a failed check unless passed, and say which one it was
+    void check(bool passed, const char* description){
+        if(passed) return;
+        ++failed_checks;
+        printf("CHECK FAILED: %s\n", description);
+    }
+
+    uint64_t ms_to_cycles(uint32_t ms){
+        return uint64_t(ms) * (sim::CPU_FREQUENCY / 1000);
+    }
+
+    //Wall clock time on the host, for code paths that don't touch any registers
+    uint64_t host_ns(){
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    //Observes which line and bit are shown on the pins and for how long
+    namespace display_observer{
+        using led_ring::BCM_RESOLUTION;
+        using led_ring::CHARLIE_PINS;
+
+        uint8_t current_line = 0;
+        uint8_t current_bit = 0;
+        uint64_t current_since = 0;
+
+        uint64_t frames = 0;
+        uint64_t bit_cycles[BCM_RESOLUTION];
+        uint64_t bit_shown[BCM_RESOLUTION];
+        uint64_t line_cycles[CHARLIE_PINS];
+        uint64_t line_shown[CHARLIE_PINS];
+
+        void reset(){
+            frames = 0;
+            memset(bit_cycles, 0, sizeof(bit_cycles));
+            memset(bit_shown, 0, sizeof(bit_shown));
+            memset(line_cycles, 0, sizeof(line_cycles));
+            memset(line_shown, 0, sizeof(line_shown));
+            current_since = sim::cycles;
+        }
+
+        void on_port_write(){
+            uint8_t line = led_ring::line_index;
+            uint8_t bit = led_ring::bit_index;
+            if(line == current_line && bit == current_bit) return;
+
+            uint64_t elapsed = sim::cycles - current_since;
+            bit_cycles[current_bit] += elapsed;
+            ++bit_shown[current_bit];
+            line_cycles[current_line] += elapsed;
+
+            if(line != current_line){
+                ++line_shown[line];
+                if(line == 0) ++frames;
+            }
+
+            current_line = line;
+            current_bit = bit;
+            current_since = sim::cycles;
+        }
+    }
+
+    //Let the display run for duration_ms, polling the calibrator like the main loop does
+    void run_calibrated(uint32_t duration_ms){
+        const uint32_t CYCLES_PER_POLL = 800;
+        uint64_t end = sim::cycles + ms_to_cycles(duration_ms);
+        while(sim::cycles < end){
+            calibrator::update();
+            sim::run_for(CYCLES_PER_POLL);
+        }
+    }
+
+    void bench_calibration(uint32_t timeout_ms){
+        using namespace led_ring;
+
+        printf("== Calibration (from no delay correction) ==\n");
+        calibrator::restart();
+
+        //Errors of the first round are those without any correction
+        int16_t initial_error[BCM_RESOLUTION] = {};
+        bool converged = false;
+        uint64_t start = sim::cycles;
+        uint16_t rounds = 0;
+        while(!converged && sim::cycles - start < ms_to_cycles(timeout_ms)){
+            run_calibrated(1);
+            if(calibrator::rounds == rounds) continue;
+            if(!rounds) memcpy(initial_error, calibrator::residual_error, sizeof(initial_error));
+            rounds = calibrator::rounds;
+
+            converged = true;
+            for(uint8_t bit = 0; bit < BCM_RESOLUTION; ++bit){
+                converged &= abs(calibrator::residual_error[bit]) <= 1;
+            }
+        }
+        printf("within 1 count on all bits: %s, after %.1f ms and %u corrections\n",
+               converged ? "yes" : "no", double(sim::cycles - start) / (sim::CPU_FREQUENCY / 1000), rounds);
+
+        calibrator::reset_stats();
+        run_calibrated(500);
+        printf("bit | target counts | correction | initial error | residual error\n");
+        for(uint8_t bit = 0; bit < BCM_RESOLUTION; ++bit){
+            printf("%3u | %13u | %10u | %13d | %14d\n", bit, BCM_BRIGHTNESS_MAP[bit],
+                   bcm_delay_correction_offset[bit], initial_error[bit], calibrator::residual_error[bit]);
+        }
+        printf("corrections after 500 ms more: %u, samples dropped by the interrupt: %u\n",
+               calibrator::rounds, unsigned(dropped_timing_samples));
+        check(converged, "calibration converges");
+        check(!dropped_timing_samples, "no timing samples dropped");
+        printf("\n");
+    }
+
+    void bench_display(uint32_t duration_ms){
+        using namespace led_ring;
+        namespace obs = display_observer;
+
+        //Let the delay correction settle before measuring
+        run_calibrated(200);
+
+        obs::reset();
+        sim::reset_accounting();
+        uint64_t start = sim::cycles;
+        run_calibrated(duration_ms);
+        uint64_t elapsed = sim::cycles - start;
+        double seconds = double(elapsed) / sim::CPU_FREQUENCY;
+        uint64_t frames = obs::frames ? obs::frames : 1;
+
+        printf("== Display (%u ms simulated, %u bit planes, gamma %s) ==\n",
+               duration_ms, BCM_RESOLUTION, IRIS_BCM_GAMMA ? "on" : "off");
+        printf("frames: %llu, frame rate: %.1f Hz\n",
+               (unsigned long long)obs::frames, obs::frames / seconds);
+        printf("frames presented: %u\n", unsigned(frames_presented));
+        printf("interrupts per frame: %.1f\n", double(sim::isr_count) / frames);
+        printf("ISR cycles per frame: %.0f (busy wait %.0f, overhead %.0f)\n",
+               double(sim::isr_cycles) / frames,
+               double(sim::busy_wait_cycles) / frames,
+               double(sim::isr_cycles - sim::busy_wait_cycles) / frames);
+        printf("CPU time in ISR: %.1f%%\n", 100.0 * sim::isr_cycles / elapsed);
+
+        printf("line | refresh rate | on time per refresh\n");
+        for(uint8_t line = 0; line < CHARLIE_PINS; ++line){
+            uint64_t shown = obs::line_shown[line] ? obs::line_shown[line] : 1;
+            printf("%4u | %9.1f Hz | %10.1f us\n", line,
+                   obs::line_shown[line] / seconds,
+                   double(obs::line_cycles[line]) / shown / (sim::CPU_FREQUENCY / 1000000));
+        }
+
+        uint64_t measured_total = 0;
+        uint32_t target_total = 0;
+        for(uint8_t bit = 0; bit < BCM_RESOLUTION; ++bit){
+            measured_total += obs::bit_cycles[bit];
+            target_total += BCM_BRIGHTNESS_MAP[bit];
+        }
+        printf("bit | target cycles | measured cycles | duty target | duty measured | error\n");
+        for(uint8_t bit = 0; bit < BCM_RESOLUTION; ++bit){
+            uint64_t shown = obs::bit_shown[bit] ? obs::bit_shown[bit] : 1;
+            double target_duty = double(BCM_BRIGHTNESS_MAP[bit]) / target_total;
+            double measured_duty = double(obs::bit_cycles[bit]) / measured_total;
+            double measured_cycles = double(obs::bit_cycles[bit]) / shown;
+            printf("%3u | %13u | %15.1f | %10.3f%% | %12.3f%% | %+6.2f%%\n", bit,
+                   BCM_BRIGHTNESS_MAP[bit] * PRESCALER_FACTOR, measured_cycles,
+                   100.0 * target_duty, 100.0 * measured_duty,
+                   100.0 * (measured_duty - target_duty) / target_duty);
+            //The calibration corrects whole timer counts, from samples that are off by up to one
+            check(fabs(measured_cycles - BCM_BRIGHTNESS_MAP[bit] * PRESCALER_FACTOR) <= 2 * PRESCALER_FACTOR,
+                  "bits are displayed within two timer counts of their duration");
+        }
+        check(obs::frames > 0, "frames are displayed");
+        printf("\n");
+    }
+
+    //Previous implementation of draw_led, writing each bit of each colour separately
+    //into a volatile frame. Extended to the brightness levels of wider bit planes
+    void reference_draw_led(volatile uint8_t (*frame)[led_ring::BCM_RESOLUTION], uint8_t channel, Color color){
+        using namespace led_ring;
+        uint8_t color_components[3] = { color.R, color.G, color.B };
+
+        for(uint8_t color_i = 0; color_i < 3; color_i++){
+            uint8_t sink_pin = pgm_read_byte(&COLOR_CHANNEL_PIN_MAP[channel][color_i][0]);
+            uint8_t source_pin = pgm_read_byte(&COLOR_CHANNEL_PIN_MAP[channel][color_i][1]);
+
+            bcm_level_t level = bcm_level(color_components[color_i]);
+            for(uint8_t bit = 0; bit < BCM_RESOLUTION; bit++){
+                bitWrite(frame[sink_pin][bit], source_pin, bitRead(level, bit));
+            }
+        }
+    }
+
+    Color random_color(){
+        return { uint8_t(rand()), uint8_t(rand()), uint8_t(rand()) };
+    }
+
+    void bench_compose(uint32_t frames){
+        using namespace led_ring;
+
+        printf("== Compose (%u frames of 12 random colours) ==\n", frames);
+
+        //Check against the previous implementation
+        uint32_t mismatches = 0;
+        for(uint32_t frame = 0; frame < 1000; ++frame){
+            Color colors[NUM_CHANNELS];
+            volatile uint8_t expected[CHARLIE_PINS][BCM_RESOLUTION] = {};
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                colors[channel] = random_color();
+                reference_draw_led(expected, channel, colors[channel]);
+            }
+
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                draw_led(channel, colors[channel]);
+            }
+            update_frame();
+            //The frame queued last, or the displayed one if it was presented already
+            const bcm_step_t (*queued)[BCM_RESOLUTION] = frame_buffers[(displayed_buffer + queued_frames) % FRAME_BUFFERS];
+            bool mismatch = false;
+            for(uint8_t sink = 0; sink < CHARLIE_PINS; ++sink){
+                for(uint8_t bit = 0; bit < BCM_RESOLUTION; ++bit){
+                    mismatch |= queued[sink][bit].port != expected[sink][bit] ||
+                                queued[sink][bit].ddr != (expected[sink][bit] | 1 << sink);
+                }
+            }
+            if(mismatch) ++mismatches;
+        }
+        printf("bit planes differing from reference: %u of 1000 frames\n", mismatches);
+        check(!mismatches, "bit planes equal the reference");
+
+        volatile uint8_t reference_frame[CHARLIE_PINS][BCM_RESOLUTION] = {};
+        Color colors[64][NUM_CHANNELS];
+        for(uint8_t i = 0; i < 64; ++i){
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                colors[i][channel] = random_color();
+            }
+        }
+
+        uint64_t start = host_ns();
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                reference_draw_led(reference_frame, channel, colors[frame % 64][channel]);
+            }
+        }
+        double reference = double(host_ns() - start) / frames;
+
+        start = host_ns();
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                draw_led(channel, colors[frame % 64][channel]);
+            }
+            update_frame();
+        }
+        double transposed = double(host_ns() - start) / frames;
+
+        printf("bit by bit: %.1f ns per frame (host)\n", reference);
+        printf("transposed: %.1f ns per frame (host), %.1fx faster\n", transposed, reference / transposed);
+        printf("\n");
+    }
+
+    //Measures stack usage by filling the unused stack below the caller with a pattern
+    //and checking how much of it was overwritten. paint and measure need to be called
+    //from the same function, so their frames start at the same address
+    namespace stack_usage{
+        const size_t AREA_SIZE = 8192;
+        //Left out at the top of the area, for the frames of paint and measure themselves
+        const size_t GUARD_SIZE = 64;
+        const uint8_t PATTERN = 0xA5;
+
+        //Return lowest address of the area below the frame of the calling function
+        inline volatile uint8_t* area(void* frame){
+            return static_cast<volatile uint8_t*>(frame) - GUARD_SIZE - AREA_SIZE;
+        }
+
+        __attribute__((noinline)) void paint(){
+            volatile uint8_t* bottom = area(__builtin_frame_address(0));
+            for(size_t i = 0; i < AREA_SIZE; ++i) bottom[i] = PATTERN;
+        }
+
+        //Return number of bytes at the top of the painted area that were overwritten
+        __attribute__((noinline)) size_t measure(){
+            volatile uint8_t* bottom = area(__builtin_frame_address(0));
+            size_t untouched = 0;
+            while(untouched < AREA_SIZE && bottom[untouched] == PATTERN) ++untouched;
+            return AREA_SIZE - untouched;
+        }
+
+        __attribute__((noinline)) void nothing(){
+            __asm__ __volatile__ ("" ::: "memory");
+        }
+
+        //Return stack bytes used by function, on top of calling an empty function.
+        //Usage within GUARD_SIZE of the caller isn't seen
+        template<typename Function>
+        size_t of(Function function){
+            paint(); nothing(); size_t baseline = measure();
+            paint(); function(); size_t used = measure();
+            return used > baseline ? used - baseline : 0;
+        }
+    }
+
+    void bench_render(uint32_t frames){
+        using namespace led_ring;
+
+        printf("== Render (%u frames) ==\n", frames);
+        for(size_t schedule_id = 0; schedule_id < Schedules::count(); ++schedule_id){
+            uint64_t start = host_ns();
+            for(uint32_t frame = 0; frame < frames; ++frame){
+                draw_schedule(schedule_id, frame * 20);
+            }
+            uint64_t elapsed = host_ns() - start;
+
+            //Move to a time the cached colours aren't valid for
+            size_t stack = stack_usage::of([=]{ draw_schedule(schedule_id, frames * 20 + 1234); });
+            printf("schedule %u: %.1f ns per frame (host), %u bytes of stack (host)\n",
+                   unsigned(schedule_id), double(elapsed) / frames, unsigned(stack));
+        }
+        printf("\n");
+    }
+
+    uint8_t color_error(Color a, Color b){
+        uint8_t error = 0;
+        error = std::max(error, uint8_t(abs(a.R - b.R)));
+        error = std::max(error, uint8_t(abs(a.G - b.G)));
+        error = std::max(error, uint8_t(abs(a.B - b.B)));
+        return error;
+    }
+
+    Cue random_cue(){
+        Cue cue;
+        cue.ramp_type = RampType(rand() % 3);
+        cue.reverse = rand() % 2;
+        cue.wrap_hue = rand() % 2;
+        cue.time_divisor = 1 + rand() % 16;
+        cue.duration = 1 + rand() % 5000;
+        cue.ramp_parameter = rand() % (cue.duration + 1);
+        cue.start_color = random_color();
+        cue.end_color = rand() % 4 ? random_color() : cue.start_color;
+        cue.blend_mode = BlendMode(rand() % 4);
+        return cue;
+    }
+
+    //Compare evaluation with render plans to Cue::interpolate
+    void bench_render_plan(uint32_t cues, uint32_t frames, RampType ramp_type){
+        using namespace led_ring;
+
+        printf("== Render plans (%u random %s cues, %u frames each) ==\n", cues,
+               ramp_type == RampType::linearHSL ? "linearHSL" : "linearRGB", frames);
+
+        uint64_t reference_ns = 0;
+        uint64_t plan_ns = 0;
+        uint64_t exact = 0;
+        uint64_t total = 0;
+        uint8_t max_error = 0;
+        volatile uint8_t sink = 0;
+
+        std::vector<uint32_t> times(frames);
+        std::vector<Color> expected(frames * NUM_CHANNELS);
+        for(uint32_t i = 0; i < cues; ++i){
+            Cue cue = random_cue();
+            cue.ramp_type = ramp_type;
+            cue.wrap_hue = rand() % 2;
+            RenderPlan plan(cue);
+
+            uint32_t time = rand();
+            for(uint32_t frame = 0; frame < frames; ++frame){
+                time += rand() % 40;
+                times[frame] = time;
+            }
+
+            uint64_t start = host_ns();
+            for(uint32_t frame = 0; frame < frames; ++frame){
+                for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                    expected[frame * NUM_CHANNELS + channel] = cue.interpolate(times[frame], channel);
+                }
+            }
+            reference_ns += host_ns() - start;
+
+            start = host_ns();
+            for(uint32_t frame = 0; frame < frames; ++frame){
+                uint32_t phase = plan.phase_at(cue, times[frame]);
+                uint32_t offset = plan.first_offset;
+                for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                    Color color = plan.evaluate(cue, plan.channel_phase(cue, phase, offset));
+                    sink = sink + color.R;
+                    plan.next_offset(cue, offset);
+                }
+            }
+            plan_ns += host_ns() - start;
+
+            for(uint32_t frame = 0; frame < frames; ++frame){
+                uint32_t phase = plan.phase_at(cue, times[frame]);
+                uint32_t offset = plan.first_offset;
+                for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                    Color color = plan.evaluate(cue, plan.channel_phase(cue, phase, offset));
+                    uint8_t error = color_error(color, expected[frame * NUM_CHANNELS + channel]);
+                    max_error = std::max(max_error, error);
+                    exact += error == 0;
+                    ++total;
+                    plan.next_offset(cue, offset);
+                }
+            }
+        }
+
+        printf("Cue::interpolate: %.1f ns per frame (host)\n", double(reference_ns) / (cues * frames));
+        printf("RenderPlan:       %.1f ns per frame (host)\n", double(plan_ns) / (cues * frames));
+        printf("exact: %.3f%%, maximum error: %u\n", 100.0 * exact / total, max_error);
+        check(max_error <= 2, "render plans are within two levels of Cue::interpolate");
+        printf("The host has a hardware divider, on AVR each avoided 32 bit division saves ~600 cycles\n");
+        printf("\n");
+    }
+
+    //Check that skipping unchanged channels yields the same colours as interpolating all of them
+    void bench_incremental(uint32_t cues, uint32_t frames){
+        using namespace led_ring;
+
+        printf("== Incremental rendering (%u random cues, %u frames each) ==\n", cues, frames);
+
+        uint32_t mismatches = 0;
+        for(uint32_t i = 0; i < cues; ++i){
+            Cues::clear();
+            Cues::push(random_cue());
+            const Cue& cue = Cues::get(0);
+
+            uint32_t time = rand();
+            for(uint32_t frame = 0; frame < frames; ++frame){
+                //Mostly small steps, sometimes jump back like looping schedules do
+                time = rand() % 32 ? time + rand() % 40 : time - rand() % 1000;
+                draw_cue(0, time);
+                //Evaluate all channels with a separate render plan
+                RenderPlan plan(cue);
+                uint32_t phase = plan.phase_at(cue, time);
+                uint32_t offset = plan.first_offset;
+                for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                    Color expected = plan.evaluate(cue, plan.channel_phase(cue, phase, offset));
+                    Color drawn = { channel_colors[channel][0], channel_colors[channel][1], channel_colors[channel][2] };
+                    if(color_error(expected, drawn)){
+                        ++mismatches;
+                    }
+                    plan.next_offset(cue, offset);
+                }
+            }
+        }
+        printf("channels differing from full interpolation: %u of %u\n",
+               mismatches, cues * frames * NUM_CHANNELS);
+        check(!mismatches, "incremental rendering equals full interpolation");
+
+        //A cue that doesn't change for a long time
+        Cues::clear();
+        Cue cue;
+        cue.duration = 60000;
+        cue.ramp_parameter = 30000;
+        cue.start_color = {10, 20, 30};
+        cue.end_color = {30, 20, 10};
+        Cues::push(cue);
+
+        uint64_t start = host_ns();
+        for(uint32_t frame = 0; frame < 100000; ++frame){
+            draw_cue(0, frame * 20);
+            update_frame();
+        }
+        printf("slow jump cue: %.1f ns per frame (host)\n", double(host_ns() - start) / 100000);
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    //Draw cues whose channels share phases, with and without evaluating each phase only once
+    void bench_phase_sharing(uint32_t frames){
+        using namespace led_ring;
+        printf("== Phase sharing (linearHSL cues, 1200 ms, %u frames) ==\n", frames);
+
+        const uint8_t divisors[] = { 1, 3, 4, 6, 12, 7 };
+        for(uint8_t time_divisor : divisors){
+            Cue cue;
+            cue.ramp_type = RampType::linearHSL;
+            cue.duration = 1200;
+            cue.ramp_parameter = 400;
+            cue.time_divisor = time_divisor;
+            cue.start_color = {255, 20, 0};
+            cue.end_color = {0, 40, 255};
+
+            double ns[2];
+            std::vector<uint8_t> colors[2];
+            uint8_t period = 0;
+            for(uint8_t shared = 0; shared < 2; ++shared){
+                Cues::clear();
+                Cues::push(cue);
+                period = Cues::plan(0).phase_period;
+                if(!shared) Cues::plan(0).phase_period = 0;
+
+                uint64_t start = host_ns();
+                for(uint32_t frame = 0; frame < frames; ++frame){
+                    draw_cue(0, frame * 20);
+                    colors[shared].insert(colors[shared].end(), &channel_colors[0][0],
+                                          &channel_colors[0][0] + sizeof(channel_colors));
+                }
+                ns[shared] = double(host_ns() - start) / frames;
+            }
+            printf("time_divisor %2u: %2u phases, %6.1f ns per frame (host), %6.1f ns shared, %s\n",
+                   time_divisor, period ? std::min<unsigned>(period, NUM_CHANNELS) : NUM_CHANNELS,
+                   ns[0], ns[1], colors[0] == colors[1] ? "same colours" : "DIFFERENT COLOURS");
+            check(colors[0] == colors[1], "shared phases give the same colours");
+        }
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    //Reference blending of a component, with exact rounding for multiply
+    uint8_t reference_blend(uint8_t below, uint8_t above, BlendMode mode){
+        switch(mode){
+            case BlendMode::add: return std::min(255, below + above);
+            case BlendMode::multiply: return (below * above + 127) / 255;
+            case BlendMode::max: return std::max(below, above);
+            default: return above;
+        }
+    }
+
+    //Compose overlapping cues with every blend mode, offset and delay and compare
+    //to blending the results of Cue::interpolate one after another
+    void bench_compositor(uint32_t frames){
+        using namespace led_ring;
+        const uint8_t CUES = 4;
+        printf("== Compositor (%u overlapping cues, %u frames) ==\n", CUES, frames);
+
+        Cues::clear();
+        Schedules::clear();
+        std::vector<Cue> cues;
+        for(uint8_t i = 0; i < CUES; ++i){
+            Cue cue = random_cue();
+            cue.channels = (rand() & 0x0FFF) | 1 << i;
+            cue.blend_mode = BlendMode(i);
+            cue.delay = rand() % 3000;
+            cue.offset_color = { uint8_t(rand() % 64), uint8_t(rand() % 64), uint8_t(rand() % 64) };
+            cues.push_back(cue);
+            Cues::push(cue);
+        }
+        //All periods are on all the time
+        Schedules::push_element(delay_t(delimiter_flag_t::schedule, 0));
+        Schedules::push_element(delay_t(uint16_t(0)));
+        for(uint8_t i = 1; i < CUES; ++i) Schedules::push_element(delay_t(delimiter_flag_t::period, i));
+
+        uint32_t mismatches = 0;
+        uint8_t max_error = 0;
+        uint64_t compose_ns = 0;
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            uint32_t time = frame * 20;
+            uint64_t start = host_ns();
+            draw_schedule(0, time);
+            compose_ns += host_ns() - start;
+
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; ++channel){
+                uint8_t expected[3] = {};
+                for(Cue& cue : cues){
+                    if(!bitRead(cue.channels, channel)) continue;
+                    uint32_t delayed = time >= cue.delay ? time - cue.delay :
+                                       time + cue.duration - cue.delay % cue.duration;
+                    Color color = cue.interpolate(delayed, channel);
+                    uint8_t components[3] = {
+                        uint8_t(std::min(255, color.R + cue.offset_color.R)),
+                        uint8_t(std::min(255, color.G + cue.offset_color.G)),
+                        uint8_t(std::min(255, color.B + cue.offset_color.B))
+                    };
+                    for(uint8_t i = 0; i < 3; ++i){
+                        expected[i] = reference_blend(expected[i], components[i], cue.blend_mode);
+                    }
+                }
+                uint8_t error = color_error({ expected[0], expected[1], expected[2] },
+                                            { channel_colors[channel][0], channel_colors[channel][1], channel_colors[channel][2] });
+                max_error = std::max(max_error, error);
+                if(error > 1) ++mismatches;
+            }
+        }
+
+        //Like before composing: every period replaces the channels of the ones before
+        uint64_t start = host_ns();
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            Schedule(0).draw(&draw_cue, frame * 20);
+            update_frame();
+        }
+        double overwrite_ns = double(host_ns() - start) / frames;
+
+        printf("channels off by more than one: %u of %u, max error: %u\n",
+               mismatches, frames * NUM_CHANNELS, max_error);
+        check(!mismatches, "composed channels are within one level of the reference");
+        printf("composed: %.1f ns per frame (host), replacing: %.1f ns per frame (host)\n",
+               double(compose_ns) / frames, overwrite_ns);
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    //Run the main loop of the sketch. Rendering takes no simulated time, so
+    //each iteration of loop() is charged a fixed amount of cycles instead.
+    //Every stall_every ms, the loop is blocked for stall_ms (e.g. by an EEPROM write)
+    //Cue IDs passed to the draw callback of a schedule, in order
+    namespace drawn_cues{
+        std::vector<uint8_t> ids;
+
+        void record(size_t cue_id, uint32_t, uint8_t){
+            ids.push_back(cue_id);
+        }
+
+        void ignore(size_t, uint32_t, uint8_t){}
+    }
+
+    //Previous implementation of Schedule::draw, summing up delays from the start
+    //of the schedule each frame
+    void reference_draw_schedule(size_t schedule_id, Schedule::draw_callback_t* draw_cue, uint32_t time){
+        uint16_t index = Schedules::first_element(schedule_id);
+        uint16_t end_index = Schedules::end_element(schedule_id);
+
+        size_t current_cue_id = Schedules::element(index).cue_id();
+        uint32_t current_delay = 0;
+        bool currently_on = true;
+
+        uint32_t schedule_duration = Schedule(schedule_id).duration();
+        if (schedule_duration == INVALID_DELAY){
+            index += 1;
+        } else {
+            if (schedule_duration != 0){
+                time = time % schedule_duration;
+            }
+            index += 2;
+        }
+
+        for (; index < end_index; ++index){
+            delay_t element = Schedules::element(index);
+            if (element.is_period_delimiter()){
+                if (currently_on) (*draw_cue)(current_cue_id, time, false);
+                current_cue_id = element.cue_id();
+                current_delay = 0;
+                currently_on = true;
+            } else if (current_delay <= time){
+                current_delay += element.delay();
+                if (current_delay <= time) currently_on = !currently_on;
+            }
+        }
+        if (currently_on) (*draw_cue)(current_cue_id, time, false);
+    }
+
+    //Configuration of the benches below. It is larger than the firmware can push into RAM,
+    //so it is mounted from an image, see mount_stored_configuration()
+    std::vector<Cue> stored_cues;
+    std::vector<delay_t> stored_elements;
+
+    //Mount stored_cues and stored_elements from an image in PROGMEM, laid out like
+    //storage::create_image() writes it. Returns false if they don't fit into the period table
+    bool mount_stored_configuration(){
+        using namespace storage;
+        static std::vector<uint8_t> image;
+        uint16_t number_of_cues = stored_cues.size();
+        uint16_t number_of_schedule_elements = stored_elements.size();
+        image.assign(STORED_HEADER_SIZE + stored_size(number_of_cues, number_of_schedule_elements), 0);
+
+        uint8_t* bytes = &image[STORED_HEADER_SIZE];
+        for(const Cue& cue : stored_cues){
+            cue.encode(bytes);
+            bytes += STORED_CUE_SIZE;
+        }
+        for(delay_t element : stored_elements) little_endian::put16(bytes, element.raw());
+
+        uint16_t crc = crc16_begin(0, number_of_cues, number_of_schedule_elements);
+        for(size_t i = STORED_HEADER_SIZE; i < image.size(); ++i) crc = crc16_update(crc, image[i]);
+        header_t header = { 0, 0, number_of_cues, number_of_schedule_elements, crc };
+        encode_header(header, &image[0]);
+        return mount_progmem(&image[0]);
+    }
+
+    //Append one schedule of periods, each toggling its cue delays times, to stored_elements.
+    //The periods use the first cues cues in turn
+    void append_dense_schedule(uint16_t periods, uint16_t delays, uint16_t duration, uint8_t cues = 3){
+        stored_elements.push_back(delay_t(delimiter_flag_t::schedule, 0));
+        stored_elements.push_back(delay_t(duration));
+        for(uint16_t period = 0; period < periods; ++period){
+            if(period) stored_elements.push_back(delay_t(delimiter_flag_t::period, period % cues));
+            for(uint16_t i = 0; i < delays; ++i){
+                //Spread the toggles over the whole duration
+                stored_elements.push_back(delay_t(uint16_t(1 + rand() % (2 * duration / delays))));
+            }
+        }
+    }
+
+    //Replace the stored configuration by cues random cues and a single dense schedule
+    void store_random_configuration(uint16_t cues, uint16_t periods, uint16_t delays, uint16_t duration, uint8_t active_cues = 3){
+        stored_cues.clear();
+        for(uint16_t i = 0; i < cues; ++i) stored_cues.push_back(random_cue());
+        stored_elements.clear();
+        append_dense_schedule(periods, delays, duration, active_cues);
+    }
+
+    void bench_schedules(uint16_t periods, uint16_t delays, uint32_t frames){
+        const uint16_t DURATION = 10000;
+
+        printf("== Schedules (%u periods of %u delays, %u frames) ==\n", periods, delays, frames);
+        store_random_configuration(0, periods, delays, DURATION);
+        if(!mount_stored_configuration()){
+            printf("does not fit into the period table\n");
+            check(false, "schedule fits into the period table");
+            printf("\n");
+            load_demo_configuration();
+            return;
+        }
+
+        uint32_t mismatches = 0;
+        uint64_t reference_ns = 0, compiled_ns = 0;
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            uint32_t time = frame * 20;
+
+            drawn_cues::ids.clear();
+            uint64_t start = host_ns();
+            reference_draw_schedule(0, &drawn_cues::record, time);
+            reference_ns += host_ns() - start;
+            std::vector<uint8_t> expected = drawn_cues::ids;
+
+            drawn_cues::ids.clear();
+            start = host_ns();
+            Schedule(0).draw(&drawn_cues::record, time);
+            compiled_ns += host_ns() - start;
+
+            if(drawn_cues::ids != expected) ++mismatches;
+        }
+
+        printf("frames drawing different cues: %u of %u\n", mismatches, frames);
+        check(!mismatches, "schedules draw the same cues as the reference");
+        printf("linear scan: %.1f ns per frame (host)\n", double(reference_ns) / frames);
+        printf("cursor:      %.1f ns per frame (host)\n", double(compiled_ns) / frames);
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    //Mount several schedules with more elements than 8 bit indices can address,
+    //and compare lookup and drawing against the reference implementation
+    void bench_schedule_table(uint16_t schedules, uint16_t periods, uint16_t delays, uint32_t frames){
+        const uint16_t DURATION = 10000;
+
+        printf("== Schedule table (%u schedules of %u periods of %u delays, %u frames) ==\n",
+               schedules, periods, delays, frames);
+        stored_cues.clear();
+        stored_elements.clear();
+        for(uint16_t schedule = 0; schedule < schedules; ++schedule){
+            append_dense_schedule(periods, delays, DURATION);
+        }
+        if(!mount_stored_configuration()){
+            printf("does not fit into the schedule table\n");
+            check(false, "schedules fit into the schedule table");
+            printf("\n");
+            load_demo_configuration();
+            return;
+        }
+        printf("%u elements, %u bytes of RAM\n", unsigned(Schedules::element_count()),
+               unsigned(Schedules::size_in_bytes() + Schedules::memory_overhead()));
+
+        //Every schedule has to start at a schedule delimiter followed by its duration
+        uint32_t broken = 0;
+        for(uint16_t schedule = 0; schedule < schedules; ++schedule){
+            uint16_t first = Schedules::first_element(schedule);
+            if(!Schedules::element(first).is_schedule_delimiter() ||
+               Schedule(schedule).duration() != DURATION ||
+               Schedules::periods_end(schedule) - Schedules::periods_begin(schedule) != periods){
+                ++broken;
+            }
+        }
+        printf("schedules with wrong index: %u of %u\n", broken, schedules);
+        check(!broken, "schedules are indexed correctly");
+
+        const uint32_t LOOKUPS = 1000000;
+        volatile uint32_t sink = 0;
+        uint64_t start = host_ns();
+        for(uint32_t i = 0; i < LOOKUPS; ++i){
+            sink += Schedules::first_element(i % schedules) + (Schedules::periods_begin(i % schedules) - Schedules::periods_begin(0));
+        }
+        printf("lookup by ID: %.1f ns (host)\n", double(host_ns() - start) / LOOKUPS);
+
+        uint32_t mismatches = 0;
+        uint64_t compiled_ns = 0;
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            uint32_t time = frame * 20;
+            size_t schedule_id = frame % schedules;
+
+            drawn_cues::ids.clear();
+            reference_draw_schedule(schedule_id, &drawn_cues::record, time);
+            std::vector<uint8_t> expected = drawn_cues::ids;
+
+            drawn_cues::ids.clear();
+            start = host_ns();
+            for(size_t id = 0; id < schedules; ++id){
+                Schedule(id).draw(id == schedule_id ? &drawn_cues::record : &drawn_cues::ignore, time);
+            }
+            compiled_ns += host_ns() - start;
+
+            if(drawn_cues::ids != expected) ++mismatches;
+        }
+        printf("frames drawing different cues: %u of %u\n", mismatches, frames);
+        check(!mismatches, "schedule table draws the same cues as the reference");
+        printf("all schedules: %.1f ns per frame (host)\n", double(compiled_ns) / frames);
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    //EEPROM writes and simulated time of a function
+    void measure_eeprom(const char* name, void (*function)()){
+        uint32_t writes = sim::eeprom_writes;
+        uint64_t start = sim::cycles;
+        function();
+        printf("%-34s %5u bytes written, %8.1f ms\n", name,
+               unsigned(sim::eeprom_writes - writes), double(sim::cycles - start) / (sim::CPU_FREQUENCY / 1000));
+    }
+
+    bool cues_equal(const Cue& a, const Cue& b){
+        return a.channels == b.channels && a.reverse == b.reverse && a.wrap_hue == b.wrap_hue &&
+               a.blend_mode == b.blend_mode &&
+               a.time_divisor == b.time_divisor && a.delay == b.delay && a.duration == b.duration &&
+               a.ramp_type == b.ramp_type && a.ramp_parameter == b.ramp_parameter &&
+               !color_error(a.start_color, b.start_color) && !color_error(a.end_color, b.end_color) &&
+               !color_error(a.offset_color, b.offset_color);
+    }
+
+    //Whether the configuration in use equals stored_cues and stored_elements
+    bool configuration_equals(){
+        bool equal = Cues::count() == stored_cues.size() && Schedules::element_count() == stored_elements.size();
+        for(size_t i = 0; equal && i < Cues::count(); ++i){
+            equal = cues_equal(Cues::get(i), stored_cues[i]);
+        }
+        for(size_t i = 0; equal && i < stored_elements.size(); ++i){
+            equal = Schedules::element(i).raw() == stored_elements[i].raw();
+        }
+        return equal;
+    }
+
+    //Previous implementation of store_all_in_eeprom, writing every byte
+    void reference_store_all(){
+        int address = 0;
+        uint16_t header[2] = { uint16_t(Cues::count()), uint16_t(Schedules::element_count()) };
+        for(uint8_t i = 0; i < sizeof(header); ++i) EEPROM[address++] = reinterpret_cast<uint8_t*>(header)[i];
+        for(size_t i = 0; i < Cues::count(); ++i){
+            for(uint8_t byte = 0; byte < sizeof(Cue); ++byte){
+                EEPROM[address++] = reinterpret_cast<const uint8_t*>(&Cues::get(i))[byte];
+            }
+        }
+        for(uint16_t index = 0; index < Schedules::element_count(); ++index){
+            delay_t element = Schedules::element(index);
+            for(uint8_t byte = 0; byte < sizeof(delay_t); ++byte){
+                EEPROM[address++] = reinterpret_cast<const uint8_t*>(&element)[byte];
+            }
+        }
+    }
+
+    void bench_storage(uint16_t cues){
+        printf("== Storage (%u cues, %u bytes per cue) ==\n", cues, unsigned(storage::STORED_CUE_SIZE));
+
+        store_random_configuration(cues, 4, 24, 10000);
+        mount_stored_configuration();
+        printf("%u bytes of cues and schedules\n",
+               unsigned(storage::stored_size(Cues::count(), Schedules::element_count())));
+
+        measure_eeprom("writing every byte:", &reference_store_all);
+        memset(sim::eeprom, 0xFF, sizeof(sim::eeprom));
+        storage::mount_eeprom();
+        mount_stored_configuration();
+
+        measure_eeprom("store to erased EEPROM:", &storage::store_all_in_eeprom);
+        measure_eeprom("store unchanged:", &storage::store_all_in_eeprom);
+
+        stored_cues[cues / 2].end_color.R ^= 0x40;
+        mount_stored_configuration();
+        measure_eeprom("store after changing a colour:", &storage::store_all_in_eeprom);
+
+        stored_cues.push_back(random_cue());
+        mount_stored_configuration();
+        measure_eeprom("store after adding a cue:", &storage::store_all_in_eeprom);
+
+        stored_elements.push_back(delay_t(delimiter_flag_t::period, 1));
+        stored_elements.push_back(delay_t(uint16_t(500)));
+        mount_stored_configuration();
+        measure_eeprom("store after adding a period:", &storage::store_all_in_eeprom);
+
+        //Too large for half of the EEPROM, so commits are written in place as well
+        stored_cues[cues / 2].end_color.G ^= 0x40;
+        mount_stored_configuration();
+        measure_eeprom("commit after changing a colour:", []{ storage::commit_to_eeprom(); });
+        measure_eeprom("commit unchanged:", []{ storage::commit_to_eeprom(); });
+
+        //Check everything is mounted back as it was stored
+        uint32_t allocations = heap_allocations;
+        uint64_t start = host_ns();
+        storage::mount_eeprom();
+        double mount_ns = host_ns() - start;
+        allocations = heap_allocations - allocations;
+        bool equal = configuration_equals();
+        printf("mounted configuration equals stored one: %s\n", equal ? "yes" : "no");
+        printf("mount: %.1f us (host), heap allocations: %u\n", mount_ns / 1000, unsigned(allocations));
+        check(equal, "stored configuration is mounted back");
+        check(!allocations, "mounting doesn't allocate");
+
+        //Flip a single bit in the middle of the stored cues
+        sim::eeprom[storage::cue_address(storage::current_header.bank, cues / 2)] ^= 0x04;
+        storage::mount_eeprom();
+        printf("cues mounted after corrupting a bit: %u\n", unsigned(Cues::count()));
+        check(!Cues::count(), "corrupted configuration isn't mounted");
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    //Bytes of RAM reserved for cues and schedules
+    size_t configuration_ram(){
+        return Cues::size_in_bytes() + Cues::memory_overhead() +
+               Schedules::size_in_bytes() + Schedules::memory_overhead();
+    }
+
+    //Bytes of the reserved RAM taken up by pushed cues and schedule elements
+    size_t configuration_ram_used(){
+        return Cues::size_in_bytes() + Schedules::size_in_bytes();
+    }
+
+    //Render frames of schedule 0 and return all channel colours
+    std::vector<uint8_t> render_frames(uint32_t frames){
+        using namespace led_ring;
+        std::vector<uint8_t> colors;
+        for(uint32_t frame = 0; frame < frames; ++frame){
+            draw_schedule(0, frame * 20);
+            colors.insert(colors.end(), &channel_colors[0][0], &channel_colors[0][0] + sizeof(channel_colors));
+        }
+        return colors;
+    }
+
+    void bench_mount(uint16_t cues, uint8_t active_cues, uint32_t frames){
+        printf("== Mounting (%u cues, %u of them in the schedule, %u frames) ==\n", cues, active_cues, frames);
+
+        memset(sim::eeprom, 0xFF, sizeof(sim::eeprom));
+        store_random_configuration(cues, 8, 16, 10000, active_cues);
+        mount_stored_configuration();
+        storage::store_all_in_eeprom();
+
+        static uint8_t image[1024];
+        size_t image_size = storage::create_image(image, sizeof(image));
+
+        //Too large to be copied to RAM with the firmware's capacities
+        const char* names[2] = { "mounted from EEPROM:", "mounted from PROGMEM:" };
+        std::vector<uint8_t> reference;
+        for(uint8_t mode = 0; mode < 2; ++mode){
+            uint32_t reads = sim::eeprom_reads;
+            uint32_t allocations = heap_allocations;
+            uint64_t start = host_ns();
+            switch(mode){
+                case 0: storage::mount_eeprom(); break;
+                case 1: storage::mount_progmem(image); break;
+            }
+            double load_us = double(host_ns() - start) / 1000;
+            reads = sim::eeprom_reads - reads;
+            allocations = heap_allocations - allocations;
+
+            Cues::cache_misses = 0;
+            start = host_ns();
+            std::vector<uint8_t> colors = render_frames(frames);
+            double render_ns = double(host_ns() - start) / frames;
+            if(mode == 0) reference = colors;
+
+            printf("%-22s %4u of %u bytes of RAM used, start: %6.1f us (host), %4u EEPROM reads, %u allocations\n",
+                   names[mode], unsigned(configuration_ram_used()), unsigned(configuration_ram()),
+                   load_us, unsigned(reads), unsigned(allocations));
+            printf("%-22s render: %6.1f ns per frame (host), %.2f cache misses per frame, %s\n", "",
+                   render_ns, double(Cues::cache_misses) / frames,
+                   colors == reference ? "same colours" : "DIFFERENT COLOURS");
+            check(colors == reference, "configurations mounted from EEPROM and PROGMEM give the same colours");
+            check(!allocations, "mounting doesn't allocate");
+        }
+        printf("PROGMEM image: %u bytes\n", unsigned(image_size));
+        printf("\n");
+
+        load_demo_configuration();
+    }
+
+    void bench_printf(uint32_t calls){
+        printf("== printf (%u calls) ==\n", calls);
+
+        SerialUSB.tx.clear();
+        SerialUSB.tx.reserve(calls * 64);
+        uint32_t allocations = heap_allocations;
+        uint64_t start = host_ns();
+        for(uint32_t i = 0; i < calls; ++i){
+            communication::printf(F("Frames: %u, late: %u, jitter: %lu us\n"), i, i / 7, (unsigned long)i * 3);
+        }
+        double call_ns = double(host_ns() - start) / calls;
+        allocations = heap_allocations - allocations;
+
+        char expected[64];
+        snprintf(expected, sizeof(expected), "\x04" "Frames: %u, late: %u, jitter: %lu us\n", 12, 1, 36ul);
+        std::string sent(SerialUSB.tx.begin(), SerialUSB.tx.end());
+        bool correct = sent.find(expected) != std::string::npos;
+        printf("%.1f ns per call (host), %.3f allocations per call, output %s\n",
+               call_ns, double(allocations) / calls, correct ? "correct" : "WRONG");
+        check(correct, "printf output is correct");
+        check(!allocations, "printf doesn't allocate");
+
+        //Nothing can be sent, printf must neither block nor overflow its buffer
+        SerialUSB.write_space = 0;
+        SerialUSB.tx.clear();
+        communication::truncated_messages = 0;
+        for(uint32_t i = 0; i < 100; ++i){
+            communication::printf(F("ERROR: Configuration in EEPROM is corrupted.\n"));
+        }
+        printf("USB stalled: %u bytes sent, %u of 100 messages truncated\n",
+               unsigned(SerialUSB.tx.size()), unsigned(communication::truncated_messages));
+        check(SerialUSB.tx.empty(), "printf sends nothing while USB is stalled");
+        SerialUSB.write_space = 64;
+        communication::flush_all();
+        SerialUSB.tx.clear();
+        printf("\n");
+    }
+
+    //Computer on the other end of SerialUSB. Requests downloads and answers
+    //every message with RequestNext after latency_ms, sending bytes_per_ms
+    namespace usb_host{
+        using namespace pb;
+        std::deque<uint8_t> outgoing;
+        size_t tx_position = 0;
+        uint32_t messages = 0;
+        uint32_t downloads = 0;
+        //Signals to send and when to send them
+        std::deque<std::pair<uint64_t, MessageData_Signal>> replies;
+        //Whether messages are answered like during a download, and the last signal received
+        bool answer = true;
+        MessageData_Signal last_signal = MessageData_Signal_Confirm;
+        //Signal requesting the next download, and when the current one was requested
+        MessageData_Signal download_signal = MessageData_Signal_DownloadConfiguration;
+        uint64_t download_started = 0;
+        uint64_t download_cycles = 0;
+        uint64_t last_run = 0;
+        double credit = 0;
+
+        void send(const MessageData& message){
+            uint8_t bytes[1024];
+            pb_ostream_t stream = pb_ostream_from_buffer(bytes, sizeof(bytes));
+            pb_encode_delimited(&stream, MessageData_fields, &message);
+            outgoing.insert(outgoing.end(), bytes, bytes + stream.bytes_written);
+        }
+
+        void send(MessageData_Signal signal){
+            MessageData message = MessageData_init_default;
+            message.which_content = MessageData_signal_tag;
+            message.content.signal = signal;
+            send(message);
+        }
+
+        //Send signal value that doesn't fit into MessageData_Signal
+        void send_signal_value(uint32_t value){
+            uint8_t bytes[8];
+            pb_ostream_t stream = pb_ostream_from_buffer(bytes, sizeof(bytes));
+            pb_encode_tag(&stream, PB_WT_VARINT, MessageData_signal_tag);
+            pb_encode_varint(&stream, value);
+            outgoing.push_back(uint8_t(stream.bytes_written));
+            outgoing.insert(outgoing.end(), bytes, bytes + stream.bytes_written);
+        }
+
+        //Set while text sent by printf is received, see skip_text
+        bool in_text = false;
+        //Bytes that were neither text nor part of a message
+        uint32_t framing_errors = 0;
+        //Number of texts received
+        uint32_t texts = 0;
+
+        //Skip text sent by printf, it runs from TEXT_MARKER to the next marker
+        void skip_text(){
+            using communication::TEXT_MARKER;
+            using communication::MESSAGE_MARKER;
+            std::vector<uint8_t>& tx = SerialUSB.tx;
+            for(; tx_position < tx.size(); ++tx_position){
+                char byte = tx[tx_position];
+                if(byte == MESSAGE_MARKER) break;
+                if(byte == TEXT_MARKER){
+                    in_text = true;
+                    ++texts;
+                }
+                else if(!in_text) ++framing_errors;
+            }
+            if(tx_position < tx.size()) in_text = false;
+        }
+
+        //Parse complete messages the firmware sent, returns true if there was one
+        bool receive(bool& confirm){
+            std::vector<uint8_t>& tx = SerialUSB.tx;
+            skip_text();
+            if(tx_position >= tx.size()) return false;
+            //Skip MESSAGE_MARKER
+            pb_istream_t stream = pb_istream_from_buffer(&tx[tx_position + 1], tx.size() - tx_position - 1);
+            MessageData message = MessageData_init_default;
+            if(!pb_decode_delimited(&stream, MessageData_fields, &message)) return false;
+            tx_position = tx.size() - stream.bytes_left;
+            if(message.which_content == MessageData_signal_tag) last_signal = message.content.signal;
+            confirm = message.which_content == MessageData_signal_tag &&
+                      message.content.signal == MessageData_Signal_Confirm;
+            return true;
+        }
+
+        void run(uint32_t latency_ms, uint32_t bytes_per_ms){
+            //Bytes trickle in at the given rate
+            credit += double(bytes_per_ms) / ms_to_cycles(1) * (sim::cycles - last_run);
+            last_run = sim::cycles;
+            while(credit >= 1 && !outgoing.empty()){
+                SerialUSB.rx.push_back(outgoing.front());
+                outgoing.pop_front();
+                credit -= 1;
+            }
+            if(outgoing.empty()) credit = 0;
+
+            bool confirm;
+            while(receive(confirm)){
+                ++messages;
+                if(!answer) continue;
+                if(confirm){
+                    ++downloads;
+                    download_cycles += sim::cycles - download_started;
+                }
+                replies.push_back(std::make_pair(sim::cycles + ms_to_cycles(latency_ms),
+                                                 confirm ? download_signal : MessageData_Signal_RequestNext));
+            }
+            while(!replies.empty() && sim::cycles >= replies.front().first){
+                if(replies.front().second == download_signal) download_started = sim::cycles;
+                send(replies.front().second);
+                replies.pop_front();
+            }
+        }
+    }
+
+    //Start over with nothing buffered on either side of the serial connection
+    void reset_serial(){
+        SerialUSB.rx.clear();
+        SerialUSB.tx.clear();
+        communication::rx_length = 0;
+        communication::rx_discard = 0;
+        communication::tx_length = 0;
+        communication::downloading = false;
+        communication::late_acknowledgements = 0;
+        communication::end_upload();
+        communication::stream_active = false;
+        usb_host::outgoing.clear();
+        usb_host::replies.clear();
+        usb_host::tx_position = 0;
+        usb_host::in_text = false;
+        usb_host::framing_errors = 0;
+        usb_host::texts = 0;
+        usb_host::messages = usb_host::downloads = 0;
+        usb_host::answer = true;
+        usb_host::download_cycles = 0;
+        usb_host::last_run = usb_host::download_started = sim::cycles;
+    }
+
+    //Run the main loop while the host downloads the configuration over and over
+    void bench_serial_io(uint32_t duration_ms, uint32_t latency_ms, uint32_t bytes_per_ms){
+        using namespace pb;
+        const uint32_t CYCLES_PER_ITERATION = 200;
+
+        printf("== Serial I/O (%u ms simulated, %u ms host latency, %u bytes per ms) ==\n",
+               duration_ms, latency_ms, bytes_per_ms);
+
+        reset_serial();
+        usb_host::download_signal = MessageData_Signal_DownloadConfiguration;
+        usb_host::send(MessageData_Signal_DownloadConfiguration);
+        communication::rejected_messages = 0;
+
+        //Frames queued before are due at times of the previous schedule
+        led_ring::drop_queued_frames();
+        frame_scheduler::begin(FRAME_PERIOD);
+        uint64_t end = sim::cycles + ms_to_cycles(duration_ms);
+        while(sim::cycles < end){
+            loop();
+            sim::run_for(CYCLES_PER_ITERATION);
+            usb_host::run(latency_ms, bytes_per_ms);
+        }
+
+        using namespace frame_scheduler;
+        printf("downloads: %u, messages: %u, rejected: %u, framing errors: %u\n", usb_host::downloads,
+               usb_host::messages, unsigned(communication::rejected_messages), unsigned(usb_host::framing_errors));
+        check(usb_host::downloads > 0, "downloads complete");
+        check(!communication::rejected_messages, "no messages are rejected");
+        check(!usb_host::framing_errors, "replies are framed correctly");
+        printf("frames: %u, late: %u, skipped: %u, max jitter: %u us\n",
+               frames, late_frames, skipped_frames, max_jitter);
+        printf("\n");
+
+        reset_serial();
+    }
+
+    //Download a configuration of cues repeatedly, waiting for each item or windowed
+    void bench_download(uint16_t cues, uint32_t latency_ms, uint32_t downloads){
+        using namespace pb;
+        const uint32_t CYCLES_PER_ITERATION = 200;
+
+        printf("== Download (%u cues, %u ms host latency) ==\n", cues, latency_ms);
+        store_random_configuration(cues, 4, 8, 10000);
+        mount_stored_configuration();
+
+        const char* names[2] = { "RequestNext per item:", "windowed:" };
+        MessageData_Signal signals[2] = { MessageData_Signal_DownloadConfiguration,
+                                          communication::MessageData_Signal_DownloadConfigurationWindowed };
+        for(uint8_t mode = 0; mode < 2; ++mode){
+            reset_serial();
+            usb_host::download_signal = signals[mode];
+            usb_host::send(signals[mode]);
+
+            //Frames queued before are due at times of the previous schedule
+            led_ring::drop_queued_frames();
+            frame_scheduler::begin(FRAME_PERIOD);
+            uint64_t end = sim::cycles + ms_to_cycles(60000);
+            while(sim::cycles < end && usb_host::downloads < downloads){
+                loop();
+                sim::run_for(CYCLES_PER_ITERATION);
+                usb_host::run(latency_ms, 1000);
+            }
+
+            printf("%-22s %7.1f ms per download, %u messages, %u late frames\n", names[mode],
+                   usb_host::downloads ? double(usb_host::download_cycles) / ms_to_cycles(1) / usb_host::downloads : 0.0,
+                   usb_host::messages / (usb_host::downloads ? usb_host::downloads : 1),
+                   frame_scheduler::late_frames);
+            check(usb_host::downloads >= downloads, "all downloads complete");
+            check(!usb_host::texts, "acknowledgements are accepted without complaint");
+        }
+        printf("\n");
+
+        reset_serial();
+        load_demo_configuration();
+    }
+
+    //Cue as it arrives after an upload, iris.proto has no ramp_parameter
+    Cue random_uploaded_cue(){
+        Cue cue = random_cue();
+        cue.channels = rand() & 0x0FFF;
+        cue.ramp_parameter = cue.duration;
+        cue.blend_mode = BlendMode::replace;
+        cue.offset_color = random_color();
+        return cue;
+    }
+
+    //Run the main loop for duration_ms, or until the firmware replied if until_reply is set.
+    //Returns ms passed
+    double run_loop(uint32_t bytes_per_ms, uint32_t duration_ms, bool until_reply = false){
+        const uint32_t CYCLES_PER_ITERATION = 200;
+        uint64_t start = sim::cycles;
+        uint64_t end = start + ms_to_cycles(duration_ms);
+        while(sim::cycles < end && !(until_reply && usb_host::messages)){
+            loop();
+            sim::run_for(CYCLES_PER_ITERATION);
+            usb_host::run(0, bytes_per_ms);
+        }
+        return double(sim::cycles - start) / ms_to_cycles(1);
+    }
+
+    //Run the main loop until the firmware replied or timeout_ms passed, returns ms passed
+    double run_until_reply(uint32_t bytes_per_ms, uint32_t timeout_ms){
+        return run_loop(bytes_per_ms, timeout_ms, true);
+    }
+
+    //Run the main loop until the half of the EEPROM not in use was brought up to date
+    //after a commit replied at cycle start, see storage::begin_mirror()
+    void wait_for_mirror(uint32_t bytes_per_ms, uint64_t start, uint32_t writes){
+        while(storage::mirroring() && sim::cycles - start < ms_to_cycles(60000)) run_loop(bytes_per_ms, 1);
+        printf("other half of the EEPROM brought up to date in %.1f ms, %u bytes written, late frames: %u\n",
+               double(sim::cycles - start) / ms_to_cycles(1), unsigned(sim::eeprom_writes - writes),
+               frame_scheduler::late_frames);
+        check(!storage::mirroring(), "the other half of the EEPROM is brought up to date");
+    }
+
+    //Upload a configuration while frames are drawn, then replace a single cue of it
+    void bench_upload(uint16_t cues, uint16_t schedules, uint32_t bytes_per_ms, uint16_t delays = 6){
+        using namespace pb;
+        printf("== Upload (%u cues, %u schedules of %u delays per period, %u bytes per ms) ==\n",
+               cues, schedules, delays, bytes_per_ms);
+
+        //Configuration in EEPROM before the upload, stored like on a new device
+        memset(sim::eeprom, 0xFF, sizeof(sim::eeprom));
+        storage::mount_eeprom();
+        load_demo_configuration();
+        storage::store_all_in_eeprom();
+        uint8_t bank = storage::staging_bank();
+        bool in_place = storage::staging_in_place();
+
+        stored_cues.clear();
+        for(uint16_t i = 0; i < cues; ++i) stored_cues.push_back(random_uploaded_cue());
+        stored_elements.clear();
+        for(uint16_t i = 0; i < schedules; ++i) append_dense_schedule(4, delays, 10000, cues);
+        mount_stored_configuration();
+        bool fits = storage::stored_size(cues, stored_elements.size()) <=
+                    uint16_t(storage::bank_end(bank) - storage::bank_begin(bank));
+
+        //Encode the upload while the configuration is still mounted
+        reset_serial();
+        usb_host::answer = false;
+        usb_host::send(communication::MessageData_Signal_UploadConfiguration);
+        for(uint16_t i = 0; i < cues; ++i){
+            MessageData message = MessageData_init_default;
+            message.which_content = MessageData_cue_tag;
+            message.content.cue = Cues::get(i).as_pb_cue();
+            usb_host::send(message);
+        }
+        for(uint16_t i = 0; i < schedules; ++i){
+            iris::Schedule schedule(i);
+            MessageData message = MessageData_init_default;
+            message.which_content = MessageData_schedule_tag;
+            message.content.schedule = schedule.as_pb_schedule();
+            usb_host::send(message);
+        }
+        usb_host::send(MessageData_Signal_Confirm);
+        size_t upload_size = usb_host::outgoing.size();
+
+        storage::mount_eeprom();
+        uint16_t previous_cues = Cues::count();
+        uint16_t previous_schedules = Schedules::count();
+        uint32_t upload_writes = sim::eeprom_writes;
+        led_ring::drop_queued_frames();
+        frame_scheduler::begin(FRAME_PERIOD);
+        //The previous configuration is shown until the upload is committed
+        double upload_ms = run_until_reply(bytes_per_ms, 500);
+        bool previous_shown = usb_host::messages ||
+                              (Cues::count() == previous_cues && Schedules::count() == previous_schedules);
+        upload_ms += run_until_reply(bytes_per_ms, 60000);
+        bool confirmed = usb_host::last_signal == MessageData_Signal_Confirm;
+        uint64_t mirror_start = sim::cycles;
+        uint32_t mirror_writes = sim::eeprom_writes;
+        upload_writes = mirror_writes - upload_writes;
+        //Frames delayed by the upload are only counted once they are drawn
+        run_loop(bytes_per_ms, 100);
+        printf("%u bytes uploaded in %.1f ms, reply: %s, rejected: %u, late frames: %u, skipped: %u, EEPROM writes: %u\n",
+               unsigned(upload_size), upload_ms, confirmed ? "Confirm" : "Error",
+               unsigned(communication::rejected_messages), frame_scheduler::late_frames,
+               frame_scheduler::skipped_frames, unsigned(upload_writes));
+        printf("previous configuration shown during the upload: %s\n", previous_shown ? "yes" : "no");
+        check(previous_shown || in_place, "previous configuration is shown during the upload");
+        check(confirmed == fits, "uploads are confirmed if they fit into half the EEPROM");
+        check(!communication::rejected_messages, "no messages are rejected");
+        if(!confirmed){
+            //Larger than half the EEPROM, the previous configuration stays
+            printf("previous configuration mounted: %s\n\n", Cues::count() == previous_cues ? "yes" : "no");
+            check(Cues::count() == previous_cues, "previous configuration stays after a failed upload");
+            reset_serial();
+            load_demo_configuration();
+            return;
+        }
+        bool equal = configuration_equals();
+        printf("mounted configuration equals uploaded one: %s\n", equal ? "yes" : "no");
+        check(equal, "uploaded configuration is mounted");
+        frame_scheduler::reset_stats();
+        wait_for_mirror(bytes_per_ms, mirror_start, mirror_writes);
+
+        //Replace a single cue, the rest stays as it is
+        reset_serial();
+        usb_host::answer = false;
+        uint8_t replaced = cues / 2;
+        stored_cues[replaced] = random_uploaded_cue();
+        usb_host::send_signal_value(communication::REPLACE_CUE_SIGNALS + replaced);
+        MessageData message = MessageData_init_default;
+        message.which_content = MessageData_cue_tag;
+        message.content.cue = stored_cues[replaced].as_pb_cue();
+        usb_host::send(message);
+        usb_host::send(MessageData_Signal_Confirm);
+
+        static uint8_t before_commit[sizeof(sim::eeprom)];
+        memcpy(before_commit, sim::eeprom, sizeof(sim::eeprom));
+        uint32_t writes = sim::eeprom_writes;
+        frame_scheduler::reset_stats();
+        double replace_ms = run_until_reply(bytes_per_ms, 60000);
+        confirmed = usb_host::last_signal == MessageData_Signal_Confirm;
+        writes = sim::eeprom_writes - writes;
+        //EEPROM right after the commit, before the other half is brought up to date
+        static uint8_t after_commit[sizeof(sim::eeprom)];
+        memcpy(after_commit, sim::eeprom, sizeof(sim::eeprom));
+        mirror_start = sim::cycles;
+        mirror_writes = sim::eeprom_writes;
+        run_loop(bytes_per_ms, 100);
+        bool atomic = storage::current_header.bank != storage::WHOLE_BANK;
+        equal = configuration_equals();
+        printf("replace cue %u: %.1f ms, reply: %s, %u bytes written to EEPROM %s, late frames: %u, skipped: %u, configuration equal: %s\n",
+               unsigned(replaced), replace_ms, confirmed ? "Confirm" : "Error",
+               unsigned(writes), atomic ? "atomically" : "in place",
+               frame_scheduler::late_frames, frame_scheduler::skipped_frames, equal ? "yes" : "no");
+        check(confirmed && equal, "replaced cue is mounted");
+        check(replace_ms < 1000, "a cue is replaced in less than a second");
+        frame_scheduler::reset_stats();
+        wait_for_mirror(bytes_per_ms, mirror_start, mirror_writes);
+
+        //Power lost right before the header was written: the previous configuration is still there
+        if(atomic){
+            memcpy(sim::eeprom, after_commit, sizeof(sim::eeprom));
+            memcpy(sim::eeprom, before_commit, storage::DATA_BEGIN);
+            storage::mount_eeprom();
+            bool previous_intact = Cues::count() == stored_cues.size();
+            for(size_t i = 0; previous_intact && i < Cues::count(); ++i){
+                previous_intact = cues_equal(Cues::get(i), stored_cues[i]) == (i != replaced);
+            }
+            printf("commit interrupted before the header: previous configuration mounted: %s\n",
+                   previous_intact ? "yes" : "no");
+            check(previous_intact, "previous configuration stays if the header isn't written");
+        }
+
+        //Host goes away in the middle of an upload
+        reset_serial();
+        usb_host::answer = false;
+        usb_host::send(communication::MessageData_Signal_UploadConfiguration);
+        for(uint16_t i = 0; i < 2; ++i){
+            MessageData message = MessageData_init_default;
+            message.which_content = MessageData_cue_tag;
+            message.content.cue = stored_cues[i].as_pb_cue();
+            usb_host::send(message);
+        }
+        run_until_reply(bytes_per_ms, communication::RECEIVE_TIMEOUT + 500);
+        printf("upload interrupted: %u of %u cues mounted afterwards\n",
+               unsigned(Cues::count()), unsigned(stored_cues.size()));
+        check(Cues::count() == stored_cues.size(), "previous configuration stays after an interrupted upload");
+        printf("\n");
+
+        reset_serial();
+        load_demo_configuration();
+    }
+
+    //Host streams frames at fps for duration_ms, leaving out every lose_every-th one
+    void bench_streaming(uint32_t fps, uint32_t duration_ms, uint32_t bytes_per_ms, uint32_t lose_every){
+        const uint32_t CYCLES_PER_ITERATION = 200;
+        using namespace led_ring;
+
+        printf("== Streaming (%u fps, %u bytes per ms", fps, bytes_per_ms);
+        if(lose_every) printf(", every %uth frame lost", lose_every);
+        printf(") ==\n");
+        reset_serial();
+        usb_host::answer = false;
+
+        uint8_t last_frame[sizeof(channel_colors)] = {};
+        uint8_t sequence = 0;
+        uint32_t sent = 0;
+        uint64_t handle_ns = 0;
+        uint32_t handled = 0;
+        uint16_t presented = frames_presented;
+
+        frame_scheduler::begin(FRAME_PERIOD);
+        uint64_t start = sim::cycles;
+        uint64_t end = start + ms_to_cycles(duration_ms);
+        uint64_t next_frame = start;
+        while(sim::cycles < end){
+            if(sim::cycles >= next_frame){
+                if(!lose_every || (sent + 1) % lose_every){
+                    for(uint8_t& component : last_frame) component = rand();
+                    usb_host::outgoing.push_back(communication::FRAME_PACKET_MARKER);
+                    usb_host::outgoing.push_back(sequence);
+                    usb_host::outgoing.insert(usb_host::outgoing.end(), last_frame, last_frame + sizeof(last_frame));
+                }
+                ++sequence;
+                ++sent;
+                next_frame += ms_to_cycles(1000) / fps;
+            }
+
+            uint16_t streamed = communication::streamed_frames;
+            uint64_t begin = host_ns();
+            loop();
+            if(communication::streamed_frames != streamed){
+                handle_ns += host_ns() - begin;
+                ++handled;
+            }
+            sim::run_for(CYCLES_PER_ITERATION);
+            usb_host::run(0, bytes_per_ms);
+        }
+        //Drain the serial connection, the last frame has to be displayed
+        sim::run_for(ms_to_cycles(20));
+        loop();
+
+        bool last_shown = !memcmp(last_frame, channel_colors, sizeof(last_frame));
+        printf("sent: %u, received: %u, dropped: %u, late: %u, presented: %u\n",
+               sent, communication::streamed_frames, communication::dropped_stream_frames,
+               communication::late_stream_frames, unsigned(uint16_t(frames_presented - presented)));
+        printf("%.1f ns per loop receiving a frame (host), last frame displayed: %s\n",
+               handled ? double(handle_ns) / handled : 0.0, last_shown ? "yes" : "no");
+
+        //Stream ends after a timeout, then the schedule is drawn again
+        end = sim::cycles + ms_to_cycles(communication::STREAM_TIMEOUT + 100);
+        while(sim::cycles < end){
+            loop();
+            sim::run_for(CYCLES_PER_ITERATION);
+        }
+        printf("streaming after timeout: %s\n", communication::streaming() ? "yes" : "no");
+        check(last_shown, "last streamed frame is displayed");
+        check(!communication::streaming(), "streaming ends after a timeout");
+        printf("\n");
+
+        reset_serial();
+    }
+
+    void bench_main_loop(uint32_t duration_ms, uint32_t stall_every, uint32_t stall_ms){
+        const uint32_t CYCLES_PER_ITERATION = 200;
+
+        printf("== Main loop (%u ms simulated, %u ms stall every %u ms) ==\n",
+               duration_ms, stall_ms, stall_every);
+
+        //Frames queued by the benchmarks before have made up presentation times
+        led_ring::drop_queued_frames();
+        frame_scheduler::begin(FRAME_PERIOD);
+        led_ring::reset_queue_stats();
+        uint16_t presented = led_ring::frames_presented;
+        uint64_t end = sim::cycles + ms_to_cycles(duration_ms);
+        uint64_t next_stall = sim::cycles + ms_to_cycles(stall_every);
+        while(sim::cycles < end){
+            loop();
+            sim::run_for(CYCLES_PER_ITERATION);
+            if(stall_ms && sim::cycles >= next_stall){
+                sim::run_for(ms_to_cycles(stall_ms));
+                next_stall += ms_to_cycles(stall_every);
+            }
+        }
+
+        using namespace frame_scheduler;
+        printf("frames: %u, late: %u, skipped: %u\n", frames, late_frames, skipped_frames);
+        printf("jitter: avg %.1f us, max %u us\n", frames ? double(total_jitter) / frames : 0.0, max_jitter);
+        printf("busy: %u us, idle: %u us\n", busy_time, idle_time);
+        check(stall_ms || (!late_frames && !skipped_frames), "no frames are late without stalls");
+
+        using namespace led_ring;
+        printf("frame queue (%u frames): presented %u, underruns: %u, overwritten: %u\n", FRAME_QUEUE_SIZE,
+               unsigned(uint16_t(frames_presented - presented)), queue_underruns, queue_overwrites);
+        printf("frames still queued when presenting:");
+        for(uint8_t queued = 0; queued < FRAME_QUEUE_SIZE; ++queued){
+            printf(" %u: %u", queued, queue_occupancy[queued]);
+        }
+        printf("\n\n");
+    }
+}
+
+int main(){
+    sim::port_write_hook = &display_observer::on_port_write;
+    sim::timer1::compare_a_vector = &led_ring::TIMER1_COMPA_vect;
+    setup();
+
+    load_demo_configuration();
+
+    led_ring::draw_schedule(1, 0);
+    bench_calibration(1000);
+    bench_display(1000);
+
+    bench_compose(100000);
+    bench_render(100000);
+    bench_render_plan(1000, 200, RampType::linearRGB);
+    bench_render_plan(1000, 200, RampType::linearHSL);
+    bench_incremental(1000, 200);
+    bench_compositor(10000);
+    bench_phase_sharing(20000);
+    bench_schedules(4, 8, 10000);
+    bench_schedules(16, 128, 10000);
+    bench_schedule_table(8, 2, 40, 10000);
+    bench_storage(20);
+    bench_mount(30, 3, 10000);
+    bench_mount(30, 8, 10000);
+    bench_printf(100000);
+    load_demo_configuration();
+    bench_main_loop(10000, 0, 0);
+    bench_serial_io(10000, 5, 1);
+    bench_serial_io(10000, 5, 100);
+    bench_download(60, 1, 5);
+    bench_download(60, 5, 5);
+    bench_upload(12, 2, 1);
+    bench_upload(12, 2, 100);
+    bench_upload(30, 3, 100);
+    //Schedule messages larger than rx_buffer
+    bench_upload(6, 1, 100, 20);
+    load_demo_configuration();
+    bench_streaming(50, 5000, 1000, 0);
+    bench_streaming(100, 5000, 1000, 10);
+    bench_streaming(100, 5000, 4, 0);
+    bench_main_loop(10000, 1000, 50);
+    bench_main_loop(10000, 1000, 100);
+
+    printf("checks failed: %u\n", failed_checks);
+    return failed_checks ? 1 : 0;
+}
@@ -6,14 +6,39 @@
 
 #include "cue.h"
 #include "schedule.h"
-#include "communication.h"
+#include "serial_text.h"
 
 #include "storage.h"
 
+//Number of bit planes per line, can be set from 8 to 16 at compile time.
+//More bit planes allow finer steps at low brightness, but lower the refresh rate
+#ifndef IRIS_BCM_RESOLUTION
+#define IRIS_BCM_RESOLUTION 8
+#endif
+
+//Apply gamma correction when converting colours to bit planes.
+//Without additional bit planes, this loses a lot of dark levels
+#ifndef IRIS_BCM_GAMMA
+#define IRIS_BCM_GAMMA (IRIS_BCM_RESOLUTION > 8)
+#endif
+
+//Number of frame buffers. One is displayed, the others queue frames rendered ahead
+//of time. Each one takes 14 * IRIS_BCM_RESOLUTION + 4 bytes of RAM, 116 bytes with
+//8 bit planes. Two queued frames bridge a stall of the main loop of two frame periods
+#ifndef IRIS_FRAME_BUFFERS
+#define IRIS_FRAME_BUFFERS 3
+#endif
+
+//Count interrupts, lines and frames displayed. Costs time in the interrupt, so it is off by default
+#ifndef IRIS_BCM_DEBUG_COUNTERS
+#define IRIS_BCM_DEBUG_COUNTERS 0
+#endif
+
 namespace freilite{
 namespace iris{
 namespace led_ring{
-    const uint8_t BCM_RESOLUTION = 8;
+    const uint8_t BCM_RESOLUTION = IRIS_BCM_RESOLUTION;
+    static_assert(BCM_RESOLUTION >= 8 && BCM_RESOLUTION <= 16, "BCM_RESOLUTION must be between 8 and 16");
     const uint8_t CHARLIE_PINS = 7;
     const uint8_t NUM_CHANNELS = 12; //each channel has three LEDs
 
@@ -22,7 +47,6 @@ namespace led_ring{
     const uint16_t PRESCALER_FACTOR = 8;
 
     //Storage for output over serial connection
-    uint16_t counts[BCM_RESOLUTION];
     uint16_t compares[BCM_RESOLUTION];
     uint16_t interrupt_counter = 0;
     uint16_t line_counter = 0;
@@ -43,35 +67,97 @@ namespace led_ring{
         PORTB = ~(1 << pin);
     }
 
+    //Pin states while one bit plane of a line is displayed. They are premasked
+    //with the line's sink pin, so the interrupt can write them as they are
+    struct bcm_step_t{
+        //Source pins of the LEDs that are on are HIGH, everything else LOW/pullup deactivated
+        uint8_t port;
+        //Source pins of the LEDs that are on and the sink pin are outputs, all others inputs
+        uint8_t ddr;
+    };
+
+    const uint8_t FRAME_BUFFERS = IRIS_FRAME_BUFFERS;
+    static_assert(FRAME_BUFFERS >= 2, "At least two frame buffers are needed to draw while displaying");
+    //Maximum number of frames queued behind the displayed one
+    const uint8_t FRAME_QUEUE_SIZE = FRAME_BUFFERS - 1;
+
+    //Ring of frames of an animation. One is displayed, the ones after it are queued
+    //in the order they are presented in, the others are free to be drawn to.
+    //The first index is equivalent to the active sink pin,
+    //The second index to the active BCM bit.
+    //Storing the values this way allows to just write one pair of bytes to 
+    //the pin registers each time a new bit starts in BCM
+    bcm_step_t frame_buffers [FRAME_BUFFERS][CHARLIE_PINS][BCM_RESOLUTION] = {};
+    //Time in ms (as returned by millis()) each queued frame is presented at
+    uint32_t presentation_times [FRAME_BUFFERS] = {};
+    //Time in ms the interrupt compares presentation_times to, set by set_display_time().
+    //Calling millis() from the interrupt would lengthen it at the end of every frame
+    volatile uint32_t display_time = 0;
+
+    //Frame currently read by the interrupt
+    bcm_step_t (* volatile displayed_frame)[BCM_RESOLUTION] = frame_buffers[0];
+    //Index of displayed_frame in frame_buffers
+    volatile uint8_t displayed_buffer = 0;
+    //Number of frames queued behind displayed_frame. Only increased by update_frame()
+    //and only decreased by the interrupt, except when frames are taken back
+    volatile uint8_t queued_frames = 0;
+
+    //Number of frames swapped in by the interrupt
+    volatile uint16_t frames_presented = 0;
+
+    //Queue statistics, reset by reset_queue_stats(). If there are underruns although
+    //the main loop keeps up on average, more frame buffers help, each at the RAM cost
+    //given at IRIS_FRAME_BUFFERS
+    //Frames queued after their presentation time, the frame before stayed on for too long
+    uint16_t queue_underruns = 0;
+    //Frames that were taken back from a full queue before they were presented
+    uint16_t queue_overwrites = 0;
+    //Number of presented frames by the number of frames that were still queued behind them
+    volatile uint16_t queue_occupancy [FRAME_QUEUE_SIZE] = {};
+
+    void reset_queue_stats(){
+        //queue_occupancy is counted by the interrupt
+        uint8_t old_sreg = SREG;
+        cli();
+        queue_underruns = 0;
+        queue_overwrites = 0;
+        memset(const_cast<uint16_t*>(queue_occupancy), 0, sizeof(queue_occupancy));
+        SREG = old_sreg;
+    }
+
+    //Return true if no further frame can be queued without replacing one
+    bool queue_full(){
+        return queued_frames == FRAME_QUEUE_SIZE;
+    }
+
+    //Let the interrupt present the queued frames due at time, a time in ms as returned
+    //by millis(). Called by the main loop on every iteration
+    void set_display_time(uint32_t time){
+        uint8_t old_sreg = SREG;
+        cli();
+        display_time = time;
+        SREG = old_sreg;
+    }
+
+    //Discard all frames that weren't presented yet, so a frame queued next is presented immediately
+    void drop_queued_frames(){
+        uint8_t old_sreg = SREG;
+        cli();
+        queued_frames = 0;
+        SREG = old_sreg;
+    }
+
     namespace {
-        //these masks are applied before setting the data direction and port registers to prevent switching the sink pin
-        uint8_t sink_mask_ddr = 0x00;
-        uint8_t sink_mask_port = 0x00;
-
-        //Set pin that'll sink current for the charlieplex display. Maximum value is 7
-        void set_sink_pin(int value){
-            //sink pin needs to be the only output pin, all others should be input
-            sink_mask_ddr = 1 << value;
-            //sink pin needs to be the only pin at LOW level, all others should be HIGH/input
-            sink_mask_port = ~sink_mask_ddr;
-
-            //set sink pin as output, all others as input
-            DDRB = sink_mask_ddr;
-            //set all pins to LOW/pullup deactivated
-            PORTB = 0;
+        //Return index of the frame buffer count buffers after buffer in the ring
+        inline uint8_t buffer_after(uint8_t buffer, uint8_t count){
+            return (buffer + count) % FRAME_BUFFERS;
         }
-    }
 
-    //One single frame of an animation
-    //The first index is equivalent to the active source pin,
-    //The second index to the active BCM bit.
-    //Storing the values this way allows to just write one byte to 
-    //the pin port each time a new bit starts in BCM
-    volatile uint8_t displayed_frame [CHARLIE_PINS][BCM_RESOLUTION] = {
-        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
-    };
+        //Overflow-safe comparison of two timestamps from millis()
+        inline bool time_reached(uint32_t now, uint32_t time){
+            return static_cast<int32_t>(now - time) >= 0;
+        }
+    }
 
     //Indices for accessing displayed_frame:
     //First index, maximum is 6
@@ -79,21 +165,41 @@ namespace led_ring{
     //Second index, maximum is BCM_RESOLUTION-1
     volatile uint8_t bit_index = 0;
 
+    //Brightness level of a colour component, one bit per bit plane
+    #if IRIS_BCM_RESOLUTION > 8
+    typedef uint16_t bcm_level_t;
+    #else
+    typedef uint8_t bcm_level_t;
+    #endif
+
+    //Timer counts the least significant bit is displayed for. Halved for each bit plane
+    //above 8, so the time per line stays the same as long as the timer resolution allows
+    const uint16_t BCM_BASE_COUNTS = BCM_RESOLUTION >= 11 ? 1 : 8 >> (BCM_RESOLUTION - 8);
+
+    //Timer counts bit is displayed for, zero for bits above BCM_RESOLUTION
+    constexpr uint16_t bcm_brightness(uint8_t bit){
+        return bit < BCM_RESOLUTION ? BCM_BASE_COUNTS << bit : 0;
+    }
+
     //Mapping of bits to time the bit is taking up in the Bit Code Modulation schedule
-    //Normally BCM_BRIGHTNESS_MAP[bit] == 1 << bit, but for gamma correction
-    //this can be adjusted
-    const uint16_t BCM_BRIGHTNESS_MAP [BCM_RESOLUTION] = {
-      //bit | delay in clock-cycles
-        [0] = 8,
-        [1] = 16,
-        [2] = 32,
-        [3] = 64,
-        [4] = 128,
-        [5] = 256,
-        [6] = 512,
-        [7] = 1024
+    //in timer counts. Only the first BCM_RESOLUTION entries are used
+    constexpr uint16_t BCM_BRIGHTNESS_MAP [16] = {
+        bcm_brightness(0), bcm_brightness(1), bcm_brightness(2), bcm_brightness(3),
+        bcm_brightness(4), bcm_brightness(5), bcm_brightness(6), bcm_brightness(7),
+        bcm_brightness(8), bcm_brightness(9), bcm_brightness(10), bcm_brightness(11),
+        bcm_brightness(12), bcm_brightness(13), bcm_brightness(14), bcm_brightness(15)
     };
 
+    //Brightness level of an 8 bit colour component with gamma correction, evaluated
+    //at compile time. x^2.2 is approximated by x^2 * (0.8 + 0.2x), which matches it
+    //at both ends. Components that aren't zero stay visible
+    constexpr bcm_level_t gamma_level(uint8_t value){
+        return value == 0 ? 0 :
+            ((1ULL << BCM_RESOLUTION) - 1) * value * value * (4 * 255 + value) < 5ULL * 255 * 255 * 255 / 2 ? 1 :
+            (((1ULL << BCM_RESOLUTION) - 1) * value * value * (4 * 255 + value) + 5ULL * 255 * 255 * 255 / 2) /
+                (5ULL * 255 * 255 * 255);
+    }
+
     namespace {
         //Allowed second index values for COLOR_CHANNEL_PIN_MAP
         enum ColorIndex{
@@ -111,7 +217,7 @@ namespace led_ring{
         };
 
         //For each channel and colour, store the sink and source pin
-        const PROGMEM uint8_t COLOR_CHANNEL_PIN_MAP [NUM_CHANNELS][3][2] = {
+        constexpr PROGMEM uint8_t COLOR_CHANNEL_PIN_MAP [NUM_CHANNELS][3][2] = {
             [0] = { 
                 [Red]   = { [Sink]=0, [Source]=1 },
                 [Green] = { [Sink]=1, [Source]=0 },
@@ -174,90 +280,513 @@ namespace led_ring{
             }
         };
 
-        inline uint8_t get_sink_pin(uint8_t channel, ColorIndex color_index){
-            return pgm_read_byte( &( COLOR_CHANNEL_PIN_MAP[channel][color_index][Sink] ) );
+        const uint8_t NO_COMPONENT = 0xFF;
+
+        //Index into channel_colors of the LED that is lit by the given sink and source pin,
+        //searching all components from index on. Evaluated at compile time only
+        constexpr uint8_t find_component(uint8_t sink, uint8_t source, uint8_t index = 0){
+            return index >= NUM_CHANNELS * 3 ? NO_COMPONENT :
+                COLOR_CHANNEL_PIN_MAP[index / 3][index % 3][Sink] == sink &&
+                COLOR_CHANNEL_PIN_MAP[index / 3][index % 3][Source] == source ? index :
+                find_component(sink, source, index + 1);
         }
 
-        inline uint8_t get_source_pin(uint8_t channel, ColorIndex color_index){
-            return pgm_read_byte( &( COLOR_CHANNEL_PIN_MAP[channel][color_index][Source] ) );
+        #define FIND_COMPONENTS(sink) { \
+            find_component(sink, 0), find_component(sink, 1), find_component(sink, 2), \
+            find_component(sink, 3), find_component(sink, 4), find_component(sink, 5), \
+            find_component(sink, 6) }
+
+        //Inverse of COLOR_CHANNEL_PIN_MAP: For each sink and source pin, store
+        //the index of the LED's component in channel_colors, or NO_COMPONENT
+        const PROGMEM uint8_t SINK_SOURCE_COMPONENT_MAP [CHARLIE_PINS][CHARLIE_PINS] = {
+            FIND_COMPONENTS(0), FIND_COMPONENTS(1), FIND_COMPONENTS(2), FIND_COMPONENTS(3),
+            FIND_COMPONENTS(4), FIND_COMPONENTS(5), FIND_COMPONENTS(6)
+        };
+
+        #undef FIND_COMPONENTS
+
+        #if IRIS_BCM_GAMMA
+        #define GAMMA_4(value) gamma_level(value), gamma_level(value + 1), \
+            gamma_level(value + 2), gamma_level(value + 3)
+        #define GAMMA_32(value) GAMMA_4(value), GAMMA_4(value + 4), GAMMA_4(value + 8), \
+            GAMMA_4(value + 12), GAMMA_4(value + 16), GAMMA_4(value + 20), \
+            GAMMA_4(value + 24), GAMMA_4(value + 28)
+
+        //Brightness level of each 8 bit colour component value
+        const PROGMEM bcm_level_t GAMMA_MAP [256] = {
+            GAMMA_32(0), GAMMA_32(32), GAMMA_32(64), GAMMA_32(96),
+            GAMMA_32(128), GAMMA_32(160), GAMMA_32(192), GAMMA_32(224)
+        };
+
+        #undef GAMMA_32
+        #undef GAMMA_4
+        #endif
+
+        //Return brightness level a colour component is displayed with. Without gamma
+        //correction, the value is scaled to the full range by repeating its top bits
+        //below it, so 255 is still the brightest level
+        inline bcm_level_t bcm_level(uint8_t value){
+            #if IRIS_BCM_GAMMA
+            return sizeof(bcm_level_t) == 1 ? pgm_read_byte( &GAMMA_MAP[value] ) : pgm_read_word( &GAMMA_MAP[value] );
+            #else
+            return BCM_RESOLUTION == 8 ? value :
+                bcm_level_t((bcm_level_t(value) << (BCM_RESOLUTION - 8)) | (value >> (16 - BCM_RESOLUTION)));
+            #endif
+        }
+
+        //Transpose an 8x8 bit matrix, see Hacker's Delight, section 7-3.
+        //Byte n of low and high (counting from the least significant byte of low)
+        //is row n. Afterwards, bit n of row m is what was bit m of row n
+        inline void transpose_8x8(uint32_t& low, uint32_t& high){
+            uint32_t t;
+            t = (high ^ (high >> 7)) & 0x00AA00AA; high = high ^ t ^ (t << 7);
+            t = (low ^ (low >> 7)) & 0x00AA00AA;   low = low ^ t ^ (t << 7);
+            t = (high ^ (high >> 14)) & 0x0000CCCC; high = high ^ t ^ (t << 14);
+            t = (low ^ (low >> 14)) & 0x0000CCCC;   low = low ^ t ^ (t << 14);
+            t = (high & 0xF0F0F0F0) | ((low >> 4) & 0x0F0F0F0F);
+            low = ((high << 4) & 0xF0F0F0F0) | (low & 0x0F0F0F0F);
+            high = t;
+        }
+
+        //Write count bit planes of the levels in rows, starting at bit first, to planes.
+        //Bit n of each plane is the bit of rows[n]
+        inline void transpose_planes(const bcm_level_t (&rows)[8], uint8_t first, uint8_t* planes, uint8_t count){
+            uint32_t low = uint32_t(uint8_t(rows[0] >> first)) | uint32_t(uint8_t(rows[1] >> first)) << 8 |
+                           uint32_t(uint8_t(rows[2] >> first)) << 16 | uint32_t(uint8_t(rows[3] >> first)) << 24;
+            uint32_t high = uint32_t(uint8_t(rows[4] >> first)) | uint32_t(uint8_t(rows[5] >> first)) << 8 |
+                            uint32_t(uint8_t(rows[6] >> first)) << 16 | uint32_t(uint8_t(rows[7] >> first)) << 24;
+
+            //Row n now holds bit plane first+n
+            transpose_8x8(low, high);
+
+            uint8_t transposed[8] = {
+                uint8_t(low), uint8_t(low >> 8), uint8_t(low >> 16), uint8_t(low >> 24),
+                uint8_t(high), uint8_t(high >> 8), uint8_t(high >> 16), uint8_t(high >> 24)
+            };
+            memcpy(planes, transposed, count);
         }
     }
 
+    //Colour components of all channels, indexed by channel and ColorIndex
+    //They are converted to displayed_frame by update_frame()
+    uint8_t channel_colors [NUM_CHANNELS][3] = {};
+
+    //Set when channel_colors differs from the last frame passed to update_frame()
+    bool frame_dirty = true;
+
     //Draw colour to a single RGB LED
+    //Only in effect after the next call of update_frame()!
     void draw_led(uint8_t channel, Color color){
-        //Unpack color components into array for easier acccess
-        uint8_t color_components[3] = { [Red]=color.R, [Green]=color.G, [Blue]=color.B };
+        uint8_t* components = channel_colors[channel];
+        if(components[Red] == color.R && components[Green] == color.G && components[Blue] == color.B){
+            return;
+        }
+        components[Red] = color.R;
+        components[Green] = color.G;
+        components[Blue] = color.B;
+        frame_dirty = true;
+    }
+
+    namespace {
+        //Convert channel_colors to bit planes and queue them to be presented at presentation_time.
+        //If the queue is full, its newest frame is replaced
+        void queue_frame(uint32_t presentation_time){
+            if(!frame_dirty) return;
+            frame_dirty = false;
+
+            //Take back the newest frame if no buffer is free, so the interrupt
+            //can't present it while we write to it. Buffers after the queued frames
+            //stay free even if the interrupt presents one in the meantime
+            uint8_t old_sreg = SREG;
+            cli();
+            if(queued_frames == FRAME_QUEUE_SIZE){
+                --queued_frames;
+                ++queue_overwrites;
+            }
+            uint8_t buffer = buffer_after(displayed_buffer, queued_frames + 1);
+            SREG = old_sreg;
+
+            const uint8_t* components = &channel_colors[0][0];
+
+            bcm_step_t (*frame)[BCM_RESOLUTION] = frame_buffers[buffer];
+            presentation_times[buffer] = presentation_time;
+
+            for(uint8_t sink = 0; sink < CHARLIE_PINS; sink++){
+                //Gather the colour components that have this sink pin, one row per source pin
+                bcm_level_t rows[8] = {};
+                for(uint8_t source = 0; source < CHARLIE_PINS; source++){
+                    uint8_t component = pgm_read_byte( &( SINK_SOURCE_COMPONENT_MAP[sink][source] ) );
+                    if(component != NO_COMPONENT){
+                        rows[source] = bcm_level(components[component]);
+                    }
+                }
 
-        for (uint8_t color_i = ColorIndex::Min; color_i <= ColorIndex::Max; color_i++){
-            uint8_t sink_pin = get_sink_pin(channel, (ColorIndex)color_i);
-            uint8_t source_pin = get_source_pin(channel, (ColorIndex)color_i);
+                //Levels wider than 8 bit are transposed one byte at a time
+                uint8_t planes[BCM_RESOLUTION];
+                transpose_planes(rows, 0, planes, 8);
+                if(BCM_RESOLUTION > 8){
+                    transpose_planes(rows, 8, planes + 8, BCM_RESOLUTION - 8);
+                }
 
-            //Write data to displayed_frame
-            for(uint8_t bit = 0; bit < BCM_RESOLUTION; bit++){
-                bitWrite(displayed_frame[sink_pin][bit], source_pin, bitRead(color_components[color_i], bit));
+                //No LED has the sink pin as its source, so it is never set in the planes
+                uint8_t sink_bit = 1 << sink;
+                for(uint8_t bit = 0; bit < BCM_RESOLUTION; bit++){
+                    frame[sink][bit].port = planes[bit];
+                    frame[sink][bit].ddr = planes[bit] | sink_bit;
+                }
             }
+
+            //The frame must be written completely before the interrupt may see it in the queue
+            __asm__ __volatile__ ("" ::: "memory");
+            old_sreg = SREG;
+            cli();
+            ++queued_frames;
+            SREG = old_sreg;
         }
     }
 
-    //Write a single line of cue to displayed_frame for the current timestep
-    void draw_cue(size_t cue_id, uint32_t time, uint8_t draw_disabled_channels = true){
-        if(cue_id >= Cues::count()) return;
+    //Convert channel_colors to bit planes and queue them to be presented at presentation_time,
+    //a time in ms as returned by millis(). If the queue is full, its newest frame is replaced.
+    //Does nothing if no colour changed since the last call
+    void update_frame(uint32_t presentation_time){
+        //Nothing was left to display when this frame became due, even if it shows no change
+        if(!queued_frames && time_reached(millis(), presentation_time)) ++queue_underruns;
+        queue_frame(presentation_time);
+    }
+
+    //Convert channel_colors to bit planes, presented as soon as the frames queued before are
+    void update_frame(){
+        queue_frame(millis());
+    }
+
+    namespace {
+        //Calculating how long a colour stays valid costs more than interpolating it.
+        //For channels that change on every frame, it is only done on every PROBE_INTERVALth miss
+        const uint8_t PROBE_INTERVAL = 16;
+
+        //Last colour a cue produced on each channel and the time span it stays valid for
+        struct channel_cache_t{
+            uint8_t cue_id;
+            Color color;
+            uint32_t valid_from;
+            uint32_t valid_until; //exclusive
+            bool reused;
+            uint8_t probe_countdown;
+        };
+
+        channel_cache_t channel_cache [NUM_CHANNELS];
+        //Revision of Cues the cache was filled with
+        uint8_t channel_cache_revision = Cues::revision() - 1;
+        //The cache holds a single cue, so overlapping cues would evict each other's colours
+        //on every frame. It belongs to the first cue composed at cache_owner_time
+        uint8_t cache_owner = INVALID_CUE_ID;
+        uint32_t cache_owner_time = 0;
+
+        //Return colour of cue on channel at time, phase being the channel's position
+        //inside the effect. Only evaluates the cue if the cached colour may have changed
+        Color cached_interpolate(const Cue& cue, const RenderPlan& plan, uint8_t cue_id,
+                                 uint32_t time, uint32_t phase, uint8_t channel){
+            if(channel_cache_revision != Cues::revision()){
+                for(uint8_t i = 0; i < NUM_CHANNELS; i++){
+                    channel_cache[i].cue_id = INVALID_CUE_ID;
+                }
+                channel_cache_revision = Cues::revision();
+            }
+
+            channel_cache_t& cache = channel_cache[channel];
+            if(cache.cue_id == cue_id && time >= cache.valid_from && time < cache.valid_until){
+                cache.reused = true;
+                return cache.color;
+            }
+
+            uint32_t stable_for = 1;
+            if(cache.cue_id != cue_id || cache.reused || cache.probe_countdown == 0){
+                stable_for = plan.stable_at_phase(cue, phase);
+                cache.probe_countdown = PROBE_INTERVAL;
+            } else {
+                --cache.probe_countdown;
+            }
+
+            cache.cue_id = cue_id;
+            cache.reused = false;
+            cache.color = plan.evaluate(cue, phase);
+            cache.valid_from = time;
+            cache.valid_until = stable_for > UINT32_MAX - time ? UINT32_MAX : time + stable_for;
+            return cache.color;
+        }
+    }
+
+    namespace {
+        //Return position of cue inside its effect at time. The effect lags behind by cue.delay
+        uint32_t delayed_phase(const Cue& cue, RenderPlan& plan, uint32_t time){
+            if(time < cue.delay){
+                time += cue.duration - cue.delay % cue.duration;
+            } else {
+                time -= cue.delay;
+            }
+            return plan.phase_at(cue, time);
+        }
+
+        inline uint8_t saturating_add(uint8_t a, uint8_t b){
+            return a > 255 - b ? 255 : a + b;
+        }
+
+        //Add offset_color of cue to a colour of its effect
+        inline Color with_offset(const Cue& cue, Color color){
+            color.R = saturating_add(color.R, cue.offset_color.R);
+            color.G = saturating_add(color.G, cue.offset_color.G);
+            color.B = saturating_add(color.B, cue.offset_color.B);
+            return color;
+        }
+
+        //Combine component of a cue with the one composed below it
+        inline uint8_t blend(uint8_t below, uint8_t above, BlendMode mode){
+            switch(mode){
+                case BlendMode::add:
+                    return saturating_add(below, above);
+                case BlendMode::multiply:
+                    //Exact for 0 and 255
+                    return (uint16_t(below) * above + 255) >> 8;
+                case BlendMode::max:
+                    return below > above ? below : above;
+                case BlendMode::replace:
+                default:
+                    return above;
+            }
+        }
+    }
+
+    //Colours composed from all cues of a frame, see begin_composition()
+    uint8_t composed_colors [NUM_CHANNELS][3] = {};
 
-        auto cue = Cues::get(cue_id);
+    //Start composing a frame from black
+    void begin_composition(){
+        memset(composed_colors, 0, sizeof(composed_colors));
+    }
+
+    //Combine colour with the one composed on a single RGB LED so far
+    //Only in effect after the next call of end_composition()!
+    inline void blend_led(uint8_t channel, Color color, BlendMode mode){
+        uint8_t* components = composed_colors[channel];
+        components[Red] = blend(components[Red], color.R, mode);
+        components[Green] = blend(components[Green], color.G, mode);
+        components[Blue] = blend(components[Blue], color.B, mode);
+    }
 
-        for(uint8_t channel = 0; channel < NUM_CHANNELS; channel++){
-            //Only get non-black color if current channel is active
-            if(bitRead(cue.channels, channel)){
-                draw_led(channel, cue.interpolate(time, channel));
+    namespace {
+        //Blend a single line of cue into composed_colors for the current timestep,
+        //with the blend mode of the cue unless replace is set
+        void compose_cue(size_t cue_id, uint32_t time, bool replace){
+            //Cues are only read, copying one would cost stack space while the interrupt may fire
+            const Cue& cue = Cues::get(cue_id);
+            RenderPlan& plan = Cues::plan(cue_id);
+            BlendMode mode = replace ? BlendMode::replace : cue.blend_mode;
+
+            uint32_t phase = delayed_phase(cue, plan, time);
+            uint32_t offset = plan.first_offset;
+
+            if(cache_owner == INVALID_CUE_ID || time != cache_owner_time){
+                cache_owner = cue_id;
+                cache_owner_time = time;
+            }
+            bool cached = cache_owner == cue_id;
+
+            //Channels plan.phase_period apart are at the same phase, so each colour is only
+            //evaluated for the first of them and kept in slot_colors[slot]
+            uint8_t period = plan.phase_period && plan.phase_period < NUM_CHANNELS ? plan.phase_period : NUM_CHANNELS;
+            uint8_t slot = 0;
+            uint16_t evaluated = 0;
+            Color slot_colors[NUM_CHANNELS];
+
+            for(uint8_t channel = 0; channel < NUM_CHANNELS; channel++){
+                if(bitRead(cue.channels, channel)){
+                    Color color;
+                    if(bitRead(evaluated, slot)){
+                        color = slot_colors[slot];
+                    } else {
+                        uint32_t channel_phase = plan.channel_phase(cue, phase, offset);
+                        color = cached ? cached_interpolate(cue, plan, cue_id, time, channel_phase, slot) :
+                                         plan.evaluate(cue, channel_phase);
+                        slot_colors[slot] = color;
+                        bitSet(evaluated, slot);
+                    }
+                    blend_led(channel, with_offset(cue, color), mode);
+                }
+                plan.next_offset(cue, offset);
+                if(++slot == period) slot = 0;
             }
-            else if(draw_disabled_channels){
-                //If desired, draw disabled channels as black
-                draw_led(channel, {0,0,0});
+        }
+
+        //Pass composed_colors on to channel_colors if they differ
+        void pass_composition(){
+            if(memcmp(channel_colors, composed_colors, sizeof(channel_colors)) != 0){
+                memcpy(channel_colors, composed_colors, sizeof(channel_colors));
+                frame_dirty = true;
             }
         }
     }
 
-    //Write a single line of a Schedule starting at schedule_begin to displayed_frame for the current timestep
+    //Blend a single line of cue into composed_colors for the current timestep,
+    //combining it with the cues blended before according to cue.blend_mode.
+    //Channels not in cue.channels stay as they are
+    void blend_cue(size_t cue_id, uint32_t time, uint8_t = false){
+        if(cue_id >= Cues::count()) return;
+        compose_cue(cue_id, time, false);
+    }
+
+    //Write a single line of cue to channel_colors for the current timestep.
+    //It is drawn on its own, so its colours replace the ones drawn before
+    void draw_cue(size_t cue_id, uint32_t time, uint8_t draw_disabled_channels = true){
+        if(cue_id >= Cues::count()) return;
+
+        if(draw_disabled_channels){
+            //Draw disabled channels as black
+            begin_composition();
+        } else {
+            memcpy(composed_colors, channel_colors, sizeof(composed_colors));
+        }
+        compose_cue(cue_id, time, true);
+        pass_composition();
+    }
+
+    //Queue composed_colors to be presented at presentation_time, only if they differ from the last frame
+    void end_composition(uint32_t presentation_time){
+        pass_composition();
+        update_frame(presentation_time);
+    }
+
+    //Queue a single line of a Schedule at timestep time, which is also the time in ms
+    //the frame is presented at. All cues that are on are composed first,
+    //so the frame is only converted once
     void draw_schedule(size_t schedule_id, uint32_t time){
-        Schedule schedule = Schedule(schedule_id);
-        if (!schedule.exists()) return;
+        if (schedule_id >= Schedules::count()) return;
 
-        schedule.draw(&draw_cue, time);
+        begin_composition();
+        Schedule(schedule_id).draw(&blend_cue, time);
+        end_composition(time);
     }
 
     //Stores correction values to be subtracted from the counter values in the brightness map
-    //They will be changed periodically if necessary
+    //They are adjusted by the calibrator and take effect with publish_bcm_timing()
     //uint8 would probably be enough, u16 is used to prevent potential overflow
-    uint16_t bcm_delay_correction_offset [BCM_RESOLUTION] = {
-        0, 0, 0, 0, 0, 0, 0, 0
+    uint16_t bcm_delay_correction_offset [BCM_RESOLUTION] = {};
+
+    //Duration of a bit in timer counts, measured by the interrupt
+    struct timing_sample_t{
+        //Bit that started when the sample was taken. The bit before it was measured
+        uint8_t bit;
+        uint16_t count;
     };
 
+    //Number of timing samples the interrupt can queue, a power of two
+    const uint8_t TIMING_SAMPLE_QUEUE_SIZE = 16;
+    static_assert((TIMING_SAMPLE_QUEUE_SIZE & (TIMING_SAMPLE_QUEUE_SIZE - 1)) == 0,
+                  "TIMING_SAMPLE_QUEUE_SIZE must be a power of two");
+
+    //Timing samples the interrupt found the queue full for
+    volatile uint16_t dropped_timing_samples = 0;
+
+    namespace {
+        //Queue of timing samples from the interrupt to the main loop.
+        //Head and tail only ever increase and wrap around, their difference is the fill level.
+        //The interrupt is the only one to write head, pop_timing_sample() the only one to write tail
+        timing_sample_t timing_samples [TIMING_SAMPLE_QUEUE_SIZE];
+        volatile uint8_t timing_sample_head = 0;
+        volatile uint8_t timing_sample_tail = 0;
+
+        //Called by the interrupt only
+        inline void push_timing_sample(uint8_t bit, uint16_t count){
+            uint8_t head = timing_sample_head;
+            if(uint8_t(head - timing_sample_tail) == TIMING_SAMPLE_QUEUE_SIZE){
+                ++dropped_timing_samples;
+                return;
+            }
+            timing_samples[head % TIMING_SAMPLE_QUEUE_SIZE] = { bit, count };
+            //The sample must be written before the main loop may see it
+            __asm__ __volatile__ ("" ::: "memory");
+            timing_sample_head = head + 1;
+        }
+    }
+
+    //Take the oldest timing sample queued by the interrupt. Returns false if there is none
+    bool pop_timing_sample(timing_sample_t& sample){
+        uint8_t tail = timing_sample_tail;
+        if(tail == timing_sample_head) return false;
+        __asm__ __volatile__ ("" ::: "memory");
+        sample = timing_samples[tail % TIMING_SAMPLE_QUEUE_SIZE];
+        __asm__ __volatile__ ("" ::: "memory");
+        timing_sample_tail = tail + 1;
+        return true;
+    }
+
+    //Discard all queued timing samples
+    void drop_timing_samples(){
+        timing_sample_tail = timing_sample_head;
+    }
+
+    //Bits shorter than this many clock cycles are displayed with busy waiting
+    //
+    //This value should be set experimentally to the lowest amount at which
+    //all measured delays (in clockcycles) per bit are equal to those
+    //specified in BCM_BRIGHTNESS_MAP. The interrupt including entry
+    //and exit needs to fit into the shortest bit it displays
+    const uint16_t MIN_INTERRUPT_CYCLES = 512;
+
+    //Return number of bits starting at bit that are shorter than MIN_INTERRUPT_CYCLES
+    constexpr uint8_t short_bits(uint8_t bit = 0){
+        return bit < BCM_RESOLUTION && BCM_BRIGHTNESS_MAP[bit] * PRESCALER_FACTOR < MIN_INTERRUPT_CYCLES ?
+            short_bits(bit + 1) : bit;
+    }
+
     //specify how many of the first bits in BCM are displayed
     //in a single call. This is important when using high clock frequencies
     //as the timer interrupt might fire at a much later point than the one
     //the timer has actually crossed the output compare register at
-    //
-    //This value should be set experimentally to the lowest amount at which
-    //all measured delays (in clockcycles) per bit are equal to those
-    //specified in BCM_BRIGHTNESS_MAP
-    const uint8_t BCM_LOOP_UNROLL_AMOUNT = 3;
-
-    //Output buffer for string formatting
-    char output_buffer[100];
-
-    //Write debugging information to SerialUSB connection
-    void print_debug_info(){
-        communication::printf(
-            F("TCNT1: %6u, %6u, %6u, %6u, %6u, %6u, %6u, %6u\n"
-              "BrtMp: %6u, %6u, %6u, %6u, %6u, %6u, %6u, %6u\n"
-              "Corrc: %6u, %6u, %6u, %6u, %6u, %6u, %6u, %6u\n"),
-            //counts is shifted by one byte as it is written to after bit_index was already advanced
-            counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], counts[7], counts[0],
-            BCM_BRIGHTNESS_MAP[0], BCM_BRIGHTNESS_MAP[1], BCM_BRIGHTNESS_MAP[2], BCM_BRIGHTNESS_MAP[3],
-            BCM_BRIGHTNESS_MAP[4], BCM_BRIGHTNESS_MAP[5], BCM_BRIGHTNESS_MAP[6], BCM_BRIGHTNESS_MAP[7],
-            bcm_delay_correction_offset[0], bcm_delay_correction_offset[1], bcm_delay_correction_offset[2], bcm_delay_correction_offset[3],
-            bcm_delay_correction_offset[4], bcm_delay_correction_offset[5], bcm_delay_correction_offset[6], bcm_delay_correction_offset[7]
-        );
+    const uint8_t BCM_LOOP_UNROLL_AMOUNT = short_bits();
+    static_assert(BCM_LOOP_UNROLL_AMOUNT < BCM_RESOLUTION, "The last bit needs to be displayed by the timer interrupt");
+
+    namespace {
+        //Two tables of the value of OCR1A for each bit displayed by the timer interrupt, or
+        //the number of _delay_loop_2 iterations for each bit displayed with busy waiting.
+        //Both include the delay correction. The interrupt reads one of them,
+        //the other one is written by publish_bcm_timing()
+        uint16_t bcm_timings [2][BCM_RESOLUTION];
+        //Index of the table in use by the interrupt
+        volatile uint8_t active_timing = 0;
+        //Set when the other table is complete, the interrupt then switches to it
+        //as soon as the current frame is over
+        volatile bool timing_published = false;
+
+        //Table the interrupt reads from
+        const uint16_t* displayed_timing = bcm_timings[0];
+        //Line of displayed_frame currently shown by the interrupt
+        const bcm_step_t* displayed_line = frame_buffers[0][0];
+
+        //Calculate timing from the delay correction, so the interrupt doesn't need to for every bit
+        void prepare_bcm_timing(uint16_t (&timing)[BCM_RESOLUTION]){
+            for(uint8_t bit = 0; bit < BCM_RESOLUTION; bit++){
+                uint16_t counts = BCM_BRIGHTNESS_MAP[bit] - bcm_delay_correction_offset[bit];
+                //the loop_2 function executes 4 cycles per iteration
+                timing[bit] = bit < BCM_LOOP_UNROLL_AMOUNT ? counts * (PRESCALER_FACTOR/4) : counts;
+            }
+        }
+    }
+
+    //Return true while timing passed to publish_bcm_timing() isn't in use yet
+    bool timing_pending(){
+        return timing_published;
+    }
+
+    //Apply bcm_delay_correction_offset from the next frame on, all bits at once.
+    //Returns false if the timing published before isn't in use yet
+    bool publish_bcm_timing(){
+        if(timing_published) return false;
+
+        prepare_bcm_timing(bcm_timings[active_timing ^ 1]);
+        //The table must be written completely before the interrupt may switch to it
+        __asm__ __volatile__ ("" ::: "memory");
+        timing_published = true;
+        return true;
     }
 
     //draw one colour to all LEDs
@@ -265,6 +794,7 @@ namespace led_ring{
         for(int i = 0; i < 12; i++){
             draw_led(i, color);
         }
+        update_frame();
     }
 
     //Initialise pins and timers for LED ring
@@ -296,6 +826,8 @@ namespace led_ring{
         draw_all_leds({0, 0, 50}); delay(1000); //All LEDs blue
         #endif
 
+        prepare_bcm_timing(bcm_timings[active_timing]);
+
         //Start timer and set prescaler
         TCCR1B |= PRESCALER_SETTING; //Set precaler to 1/64
 
@@ -307,81 +839,92 @@ namespace led_ring{
     }
 
     //Main interrupt for executing Bit Code Modulation
+    //It only copies pin states and timer values prepared in advance, so as little
+    //time as possible passes between the compare match and the pins changing
     ISR( TIMER1_COMPA_vect ){
         int old_sreg = SREG;
         cli(); //pause interrupts
 
-        //debugging
+        #if IRIS_BCM_DEBUG_COUNTERS
         ++interrupt_counter;
+        #endif
 
         //advance bit index
-        bit_index = (bit_index + 1) % BCM_RESOLUTION;
+        uint8_t bit = bit_index + 1;
 
         //Loop unrolling
-        if(bit_index == 0){
+        if(bit == BCM_RESOLUTION){
+            bit = 0;
+            bit_index = 0;
+            uint8_t line = line_index + 1;
+            #if IRIS_BCM_DEBUG_COUNTERS
             ++line_counter;
-            ++line_index;
+            #endif
             //after all bits have been rendered,
             //draw the next line
-            if(line_index == CHARLIE_PINS){
-                line_index = 0;
+            if(line == CHARLIE_PINS){
+                line = 0;
+                #if IRIS_BCM_DEBUG_COUNTERS
                 ++frame_counter;
+                #endif
+
+                //Only swap frames at this point to prevent tearing.
+                //Queued frames are presented one per refresh, once they are due
+                if(queued_frames){
+                    uint8_t next_buffer = buffer_after(displayed_buffer, 1);
+                    if(time_reached(display_time, presentation_times[next_buffer])){
+                        --queued_frames;
+                        ++queue_occupancy[queued_frames];
+                        displayed_buffer = next_buffer;
+                        displayed_frame = frame_buffers[next_buffer];
+                        ++frames_presented;
+                    }
+                }
+
+                //Timing changes at the same point, so all bits of a frame are corrected alike
+                if(timing_published){
+                    active_timing ^= 1;
+                    displayed_timing = bcm_timings[active_timing];
+                    timing_published = false;
+                }
             }
-            set_sink_pin(line_index);
+            line_index = line;
+            displayed_line = displayed_frame[line];
+
+            //Turn off the previous line before setting the sources of the next one:
+            //only the sink pin is an output, all pins are LOW/pullup deactivated
+            DDRB = displayed_line[0].ddr ^ displayed_line[0].port;
+            PORTB = 0;
 
-            while(bit_index < BCM_LOOP_UNROLL_AMOUNT){
+            while(bit < BCM_LOOP_UNROLL_AMOUNT){
                 //draw line
-                PORTB = sink_mask_port & displayed_frame[line_index][bit_index];
-                DDRB = sink_mask_ddr | displayed_frame[line_index][bit_index];
+                PORTB = displayed_line[bit].port;
+                DDRB = displayed_line[bit].ddr;
 
                 //log time for previous line index and reset timer
-                counts[bit_index] = TCNT1;
+                uint16_t count = TCNT1;
                 TCNT1 = 0;
+                push_timing_sample(bit, count);
 
-                //busy delay. the loop_2 function executes 4 cycles per iteration
-                _delay_loop_2(
-                    (BCM_BRIGHTNESS_MAP[bit_index] - bcm_delay_correction_offset[bit_index]) 
-                    * (PRESCALER_FACTOR/4)
-                );
+                //busy delay
+                _delay_loop_2(displayed_timing[bit]);
 
-                bit_index++;
+                bit_index = ++bit;
             }
         }
+        bit_index = bit;
 
-        //set delay for next bit (subtracting a correction amount to compensate
-        //for "wasted" instructions inside this interrupt handler)
-        OCR1A = BCM_BRIGHTNESS_MAP[bit_index] - bcm_delay_correction_offset[bit_index];
+        //set delay for next bit, already corrected for the instructions of this handler
+        OCR1A = displayed_timing[bit];
 
         //draw line
-        PORTB = sink_mask_port & displayed_frame[line_index][bit_index];
-        DDRB = sink_mask_ddr | displayed_frame[line_index][bit_index];
+        PORTB = displayed_line[bit].port;
+        DDRB = displayed_line[bit].ddr;
 
-        counts[bit_index] = TCNT1; //log time for previous line index
+        uint16_t count = TCNT1; //log time for previous line index
         TCNT1 = 0; //reset timer. This needs to happen directly after time logging to guarantee accurate results
+        push_timing_sample(bit, count);
         SREG = old_sreg; //turn on interrupts again
-
-        //Adjust delay correction
-        if(bit_index + 1 == BCM_RESOLUTION){
-            for(uint8_t i = 0; i < BCM_RESOLUTION; i++){
-                //counts is shifted by one byte as it is written to after bit_index was already advanced
-                uint16_t measured_count = counts[(i+1) % BCM_RESOLUTION];
-                uint16_t target_count = BCM_BRIGHTNESS_MAP[i];
-
-                //Underflow doesn't need to be checked for, it can not occur
-                //We only increment/decrement as the delay correction is updated very frequently
-                //That way they also work for interrupt und loop unrolled bits
-
-                if(target_count > measured_count){
-                    //correction is subtracted from timer/delay values,
-                    //so if we measure too few counts, the correction is too high
-                    --(bcm_delay_correction_offset[i]);
-                } else if (target_count < measured_count){
-                    //if we measure to many counts, the correction is too low
-                    if(bcm_delay_correction_offset[i] + 1 < BCM_BRIGHTNESS_MAP[i])
-                        ++(bcm_delay_correction_offset[i]);
-                }
-            }
-        }
     }
 }
 }
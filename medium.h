@@ -0,0 +1,70 @@
+//Read-only memory that stored cues and schedules can be used from without copying them to RAM
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+#include <EEPROM.h>
+
+namespace freilite{
+namespace iris{
+    struct medium_t{
+        //Copy length bytes starting at address to bytes
+        void (*read_function)(const uint8_t* base, uint16_t address, uint8_t* bytes, uint8_t length);
+        //Start of the data, for media that are addressed by pointer
+        const uint8_t* base;
+
+        void read(uint16_t address, uint8_t* bytes, uint8_t length) const{
+            read_function(base, address, bytes, length);
+        }
+    };
+
+    namespace media{
+        namespace {
+            void read_eeprom(const uint8_t*, uint16_t address, uint8_t* bytes, uint8_t length){
+                for(uint8_t i = 0; i < length; ++i){
+                    bytes[i] = EEPROM.read(address + i);
+                }
+            }
+
+            void read_progmem(const uint8_t* base, uint16_t address, uint8_t* bytes, uint8_t length){
+                for(uint8_t i = 0; i < length; ++i){
+                    bytes[i] = pgm_read_byte(base + address + i);
+                }
+            }
+        }
+
+        //Addresses are EEPROM addresses
+        const medium_t eeprom = { &read_eeprom, nullptr };
+
+        //Addresses are relative to image, which needs to be stored in PROGMEM
+        inline medium_t progmem(const uint8_t* image){
+            return { &read_progmem, image };
+        }
+    }
+
+    //Conversion of values stored on a medium, which are all little-endian
+    namespace little_endian{
+        inline void put16(uint8_t*& bytes, uint16_t value){
+            *bytes++ = value;
+            *bytes++ = value >> 8;
+        }
+
+        inline void put32(uint8_t*& bytes, uint32_t value){
+            put16(bytes, value);
+            put16(bytes, value >> 16);
+        }
+
+        inline uint16_t get16(const uint8_t*& bytes){
+            uint16_t value = bytes[0] | uint16_t(bytes[1]) << 8;
+            bytes += 2;
+            return value;
+        }
+
+        inline uint32_t get32(const uint8_t*& bytes){
+            uint32_t value = get16(bytes);
+            return value | uint32_t(get16(bytes)) << 16;
+        }
+    }
+}
+}
@@ -3,6 +3,9 @@
 
 #include <ArduinoSTL.h>
 
+#include "arena.h"
+#include "medium.h"
+
 #include <pb_encode.h>
 #include <pb_decode.h>
 namespace pb{
@@ -47,7 +50,7 @@ namespace iris{
     const uint16_t MAXIMUM_DELAY    = 0xFDFE;
     const uint16_t INVALID_DELAY    = 0xFDFF;
     //The delay values could be a little larger,
-    //but the first two bytes being FD guarantees even INVALID_DELAY
+    //but the high byte being FD guarantees even INVALID_DELAY
     //to not be ambiguous with a period or schedule delimiter
 
     enum class delimiter_flag_t : uint8_t{
@@ -57,10 +60,13 @@ namespace iris{
 
     struct delay_t{
         private:
+            //The flag has to overlap the high byte of delay, so that no delay
+            //up to MAXIMUM_DELAY can be mistaken for a delimiter.
+            //This order achieves that on little-endian targets like AVR
             union{
                 struct{
-                    delimiter_flag_t flag;
                     uint8_t cue_id;
+                    delimiter_flag_t flag;
                 } delimiter;
                 uint16_t delay; //Duration of schedule if previous element was a schedule delimiter
             } _value;
@@ -104,71 +110,285 @@ namespace iris{
             delay_t(uint16_t delay){
                 _value.delay = delay;
             }
+
+            //Return both bytes of the element as one value, the inverse of the constructor for delay
+            uint16_t raw() const{
+                return _value.delay;
+            }
     };
 
-    //Storage for schedules
+    //A period of a loaded schedule, compiled when its elements are pushed.
+    //The cue of a period is on at the start of the schedule and toggles
+    //each time one of its delays has passed
+    struct period_t{
+        //Index of the first and after the last delay, see Schedules::element()
+        uint16_t begin;
+        uint16_t end;
+        uint8_t cue_id;
+
+        //Cursor into the delays, advanced as time passes.
+        //Index of the first delay that hasn't passed at cursor_time
+        uint16_t cursor;
+        //Sum of all delays before cursor
+        uint32_t cursor_time;
+        bool on;
+
+        period_t() : period_t(INVALID_CUE_ID, 0){}
+
+        period_t(uint8_t cue_id, uint16_t begin) :
+            begin(begin), end(begin), cue_id(cue_id), cursor(begin), cursor_time(0), on(true)
+        {}
+    };
+
+    //Capacities of the storage for schedules, all of it is reserved in RAM at compile time.
+    //Elements only count if they are pushed, periods and schedules also if they are mounted
+    #ifndef IRIS_MAX_SCHEDULE_ELEMENTS
+    #define IRIS_MAX_SCHEDULE_ELEMENTS 16
+    #endif
+    #ifndef IRIS_MAX_PERIODS
+    #define IRIS_MAX_PERIODS 16
+    #endif
+    #ifndef IRIS_MAX_SCHEDULES
+    #define IRIS_MAX_SCHEDULES 8
+    #endif
+
+    //Storage for schedules. The first schedule elements can be used directly
+    //from a medium they are stored on, see mount(). Pushed elements are
+    //stored in RAM after them. Only the period table is always kept in RAM
     namespace Schedules{
         namespace{
             //Storage for all schedules currently loaded
-            std::vector<delay_t> loaded_schedules;
+            arena_t<delay_t, IRIS_MAX_SCHEDULE_ELEMENTS> loaded_schedules;
 
             //Index map for schedules
-            //For a schedule_id it stores the index where that schedule starts in loaded_schedules
-            std::vector<uint8_t> schedule_indices;
+            //For a schedule_id it stores the index of the element the schedule starts at.
+            //Mounted elements count as well, so these are always 16 bits wide
+            arena_t<uint16_t, IRIS_MAX_SCHEDULES> schedule_indices;
+
+            //All periods of all schedules, in the order they were loaded
+            arena_t<period_t, IRIS_MAX_PERIODS> loaded_periods;
+
+            //For a schedule_id it stores the index of its first period in loaded_periods,
+            //one byte wide as long as IRIS_MAX_PERIODS is below 256
+            arena_t<index_for<IRIS_MAX_PERIODS>::type, IRIS_MAX_SCHEDULES> period_indices;
+
+            //Mounted element i is stored at mounted_address + i * mounted_step
+            medium_t mounted_medium;
+            uint16_t mounted_address = 0;
+            int8_t mounted_step = 0;
+            uint16_t mounted_count = 0;
+
+            //True if the last compiled element was a schedule delimiter
+            bool after_schedule_delimiter = false;
+
+            //Add an element with index to the index maps and the period table.
+            //Returns false if one of them is full
+            bool compile_element(delay_t schedule_element, uint16_t index){
+                if (schedule_element.is_delimiter() && loaded_periods.full()) return false;
+
+                //If a schedule delimiter is pushed, its index is added to the index map
+                if (schedule_element.is_schedule_delimiter()){
+                    if (schedule_indices.full()) return false;
+                    schedule_indices.push_back(index);
+                    period_indices.push_back(loaded_periods.size());
+                }
+
+                if (schedule_element.is_delimiter()){
+                    loaded_periods.push_back(period_t(schedule_element.cue_id(), index + 1));
+                } else if (!loaded_periods.empty()){
+                    period_t& period = loaded_periods.back();
+                    if (after_schedule_delimiter){
+                        //Duration of the schedule, the first delay follows
+                        period.begin = period.end = period.cursor = index + 1;
+                    } else {
+                        period.end = index + 1;
+                    }
+                }
+
+                after_schedule_delimiter = schedule_element.is_schedule_delimiter();
+                return true;
+            }
+        }
+
+        //Return number of loaded schedules
+        static size_t count(){
+            return schedule_indices.size();
         }
 
-        //Return const iterator to starting schedule delimiter of schedule with ID schedule_id
-        //Will return iterator to end of loaded_schedules if schedule_id is too large
-        static std::vector<delay_t>::const_iterator begin_by_id(size_t schedule_id){
+        //Return number of schedule elements
+        static size_t element_count(){
+            return mounted_count + loaded_schedules.size();
+        }
+
+        //Return schedule element with index, counting over all schedules
+        static delay_t element(uint16_t index){
+            if (index >= mounted_count) return loaded_schedules[index - mounted_count];
+
+            uint8_t bytes[2];
+            mounted_medium.read(mounted_address + int16_t(index) * mounted_step, bytes, sizeof(bytes));
+            return delay_t(uint16_t(bytes[0] | uint16_t(bytes[1]) << 8));
+        }
+
+        //Return index of the starting schedule delimiter of schedule with ID schedule_id
+        //Will return element_count() if schedule_id is too large
+        static uint16_t first_element(size_t schedule_id){
             if(schedule_id >= schedule_indices.size()){
-                return loaded_schedules.end();
+                return element_count();
             }
-            return loaded_schedules.begin() + schedule_indices[schedule_id];
+            return schedule_indices[schedule_id];
         }
 
-        //Return const iterator pointing directly after end of schedule with ID schedule_id
-        static std::vector<delay_t>::const_iterator end_by_id(size_t schedule_id){
+        //Return index directly after the end of schedule with ID schedule_id
+        static uint16_t end_element(size_t schedule_id){
             //All schedules end before the beginning of the next schedule
-            return begin_by_id(schedule_id + 1);
+            return first_element(schedule_id + 1);
         }
 
-        //Load a schedule element
-        static void push_element(delay_t schedule_element){
-            //If a schedule delimiter is pushed, its index is added to the index map
-            if (schedule_element.is_schedule_delimiter()){
-                schedule_indices.push_back(loaded_schedules.size());
-            }
+        //Load a schedule element. Returns false if there is no room for it
+        static bool push_element(delay_t schedule_element){
+            if (loaded_schedules.full()) return false;
+            if (!compile_element(schedule_element, element_count())) return false;
             loaded_schedules.push_back(schedule_element);
+            return true;
+        }
+
+        //Return number of schedule elements that can still be pushed
+        static size_t free_slots(){
+            return loaded_schedules.capacity() - loaded_schedules.size();
         }
 
         //Unload all schedules
         static void clear(){
             loaded_schedules.clear();
             schedule_indices.clear();
+            loaded_periods.clear();
+            period_indices.clear();
+            mounted_count = 0;
+            after_schedule_delimiter = false;
         }
 
-        //Return number of loaded schedules
-        static size_t count(){
-            return schedule_indices.size();
+        //Unload all schedules and use count elements stored on medium instead, each as the
+        //two bytes of delay_t::raw(). Element i is stored at address + i * step.
+        //Reads all elements once to compile the period table. The medium must not change while mounted.
+        //Returns false and leaves nothing loaded if the period table is too small for them
+        static bool mount(const medium_t& medium, uint16_t address, int8_t step, uint16_t count){
+            clear();
+            mounted_medium = medium;
+            mounted_address = address;
+            mounted_step = step;
+            mounted_count = count;
+            for(uint16_t index = 0; index < count; ++index){
+                if (!compile_element(element(index), index)){
+                    clear();
+                    return false;
+                }
+            }
+            return true;
         }
 
-        //Return number of schedule elements
-        static size_t element_count(){
-            return loaded_schedules.size();
+        //Return pointer to first period of schedule with ID schedule_id
+        //Will return pointer to end of loaded_periods if schedule_id is too large
+        static period_t* periods_begin(size_t schedule_id){
+            if(schedule_id >= period_indices.size()){
+                return loaded_periods.end();
+            }
+            return loaded_periods.begin() + period_indices[schedule_id];
+        }
+
+        //Return pointer directly after last period of schedule with ID schedule_id
+        static period_t* periods_end(size_t schedule_id){
+            return periods_begin(schedule_id + 1);
         }
 
-        //Calculate size of actual information stored for schedules
+        //Return true if the cue of period is on at time inside its schedule.
+        //Amortised constant time as long as time only increases
+        static bool is_on(period_t& period, uint32_t time){
+            //Restart when time moved backwards, e.g. when the schedule looped
+            if (time < period.cursor_time){
+                period.cursor = period.begin;
+                period.cursor_time = 0;
+                period.on = true;
+            }
+
+            while (period.cursor < period.end){
+                uint32_t toggle_time = period.cursor_time + element(period.cursor).delay();
+                if (toggle_time > time) break;
+
+                period.cursor_time = toggle_time;
+                period.on = !period.on;
+                ++period.cursor;
+            }
+
+            return period.on;
+        }
+
+        //State of decoding a pb::Schedule straight into schedule elements,
+        //so it never has to be held in RAM as a whole. Its fields are passed in
+        //one by one as they arrive, see begin_decoding()
+        struct decoder_t{
+            //Fields of the schedule and of the period being decoded
+            uint32_t duration;
+            uint32_t cue_id;
+            //Number of periods decoded so far
+            uint16_t periods;
+            //Whether the delimiter of the period being decoded was pushed
+            bool delimiter_pushed;
+            //Called with each decoded element, see begin_decoding()
+            bool (*push)(delay_t element);
+        };
+
+        namespace{
+            //Push delimiter of the period being decoded, the first one starts the schedule
+            bool push_period_delimiter(decoder_t& decoder){
+                decoder.delimiter_pushed = true;
+                uint8_t cue_id = decoder.cue_id <= MAXIMUM_CUE_ID ? decoder.cue_id : MAXIMUM_CUE_ID;
+                if (decoder.periods++ != 0){
+                    return decoder.push(delay_t(delimiter_flag_t::period, cue_id));
+                }
+                //Always store the duration, otherwise the first delay would be taken for it
+                return decoder.push(delay_t(delimiter_flag_t::schedule, cue_id)) &&
+                       decoder.push(delay_t(uint16_t(decoder.duration <= MAXIMUM_DELAY ? decoder.duration : MAXIMUM_DELAY)));
+            }
+        }
+
+        //Start decoding a schedule. Its duration has to be set before the first period.
+        //Decoded elements are passed to push, which returns false if there is no room for them.
+        //At most three are passed per call of push_delay() or end_period()
+        static void begin_decoding(decoder_t& decoder, bool (*push)(delay_t element) = &push_element){
+            decoder.duration = 0;
+            decoder.periods = 0;
+            decoder.push = push;
+        }
+
+        //Start the next period, its cue_id has to be set before the first delay
+        static void begin_period(decoder_t& decoder){
+            decoder.cue_id = 0;
+            decoder.delimiter_pushed = false;
+        }
+
+        //Push a delay of the current period. Returns false if there is no room for it
+        static bool push_delay(decoder_t& decoder, uint32_t delay){
+            if (!decoder.delimiter_pushed && !push_period_delimiter(decoder)) return false;
+            return decoder.push(delay_t(uint16_t(delay <= MAXIMUM_DELAY ? delay : MAXIMUM_DELAY)));
+        }
+
+        //End the current period, periods without delays are pushed as well
+        static bool end_period(decoder_t& decoder){
+            return decoder.delimiter_pushed || push_period_delimiter(decoder);
+        }
+
+        //Calculate size of actual information stored for schedules in RAM
         static size_t size_in_bytes(){
-            return loaded_schedules.size() *
-                    sizeof(decltype(loaded_schedules)::value_type);
+            return loaded_schedules.size_in_bytes();
         }
 
-        //Calculate overhead in bytes of schedules when stored in memory
+        //Calculate overhead in bytes of schedules when stored in memory,
+        //including storage reserved for elements that haven't been pushed
         static size_t memory_overhead(){
-            return sizeof(loaded_schedules) +
+            return loaded_schedules.memory_overhead() +
                     sizeof(schedule_indices) +
-                    schedule_indices.size() *
-                    sizeof(decltype(schedule_indices)::value_type);
+                    sizeof(loaded_periods) +
+                    sizeof(period_indices);
         }
     }
 
@@ -177,12 +397,6 @@ namespace iris{
         private:
             size_t id;
 
-            //Holds begin and end iterator for one Period
-            struct period_range_t{
-                std::vector<delay_t>::const_iterator begin;
-                std::vector<delay_t>::const_iterator end;
-            };
-
             //Encode Periods inside a schedule as a nanopb callback
             static bool encode_periods(pb_ostream_t* stream,
                                        const pb_field_t* field,
@@ -190,50 +404,18 @@ namespace iris{
                 using namespace pb;
 
                 const Schedule* schedule = static_cast<const Schedule*>(*arg);
-                auto iter = schedule->begin();
-                auto end = schedule->end();
-
-                //Prepare period for encoding delays
-                pb::Schedule_Period pb_period = Schedule_Period_init_default;
-                pb_period.cue_id = iter->cue_id();
-
-                //Advance iterator
-                if (schedule->duration() == INVALID_DELAY){
-                    //Jump over Schedule delimiter
-                    iter += 1;
-                } else {
-                    //Jump over Schedule delimiter and duration
-                    iter += 2;
-                }
-
-                //Create range
-                period_range_t period_range = {iter, iter};
-                pb_period.delays.funcs.encode = &encode_delays;
-                pb_period.delays.arg = &period_range;
-
-                while(true){
-                    //Reached end of this period
-                    if(iter >= end || iter->is_delimiter()){
-                        //Send period as message
-                        period_range.end = iter;
-
-                        if(!pb_encode_tag_for_field(stream, field))
-                            return false;
-                        if(!pb_encode_submessage(stream, pb::Schedule_Period_fields, &pb_period))
-                            return false;
-
-                        //Stop when schedule is over
-                        if(iter >= end || iter->is_schedule_delimiter()){
-                            break;
-                        }
-
-                        //Reset range for next period
-                        period_range.begin = iter + 1; //Skip delimiter
-                        pb_period.cue_id = iter->cue_id();
-                    }
-
-                    //Increment iterator
-                    ++iter;
+                auto end = Schedules::periods_end(schedule->id);
+                for(auto period = Schedules::periods_begin(schedule->id); period != end; ++period){
+                    pb::Schedule_Period pb_period = Schedule_Period_init_default;
+                    pb_period.cue_id = period->cue_id;
+                    pb_period.delays.funcs.encode = &encode_delays;
+                    pb_period.delays.arg = const_cast<period_t*>(&*period);
+
+                    //Send period as message
+                    if(!pb_encode_tag_for_field(stream, field))
+                        return false;
+                    if(!pb_encode_submessage(stream, pb::Schedule_Period_fields, &pb_period))
+                        return false;
                 }
 
                 return true;
@@ -243,15 +425,16 @@ namespace iris{
             static bool encode_delays(pb_ostream_t* stream,
                                       const pb_field_t* field,
                                       void* const* arg){
-                const period_range_t* period_range = static_cast<const period_range_t*>(*arg);
-                for(auto iter = period_range->begin; iter < period_range->end; ++iter){
+                const period_t* period = static_cast<const period_t*>(*arg);
+                for(uint16_t index = period->begin; index < period->end; ++index){
                     //Use non-packed repeated field for now
                     if(!pb_encode_tag_for_field(stream, field))
                         return false;
                     //Encode actual delay
-                    if(!pb_encode_varint(stream, iter->delay()))
+                    if(!pb_encode_varint(stream, Schedules::element(index).delay()))
                         return false;
                 }
+                return true;
             }
 
         public: //non-static
@@ -261,9 +444,9 @@ namespace iris{
             uint16_t duration() const{
                 //If there is a duration specified, it's directly after
                 //the schedule delimiter
-                auto iter = begin() + 1;
-                if (iter != end() && iter->is_delay()){
-                    return iter->delay();
+                uint16_t index = begin() + 1;
+                if (index < end() && Schedules::element(index).is_delay()){
+                    return Schedules::element(index).delay();
                 }
                 //It is important to know whether the duration was
                 //explicitly 0 or not set at all.
@@ -275,14 +458,14 @@ namespace iris{
                 return id < Schedules::count();
             }
 
-            //Return const iterator to starting schedule delimiter of schedule
-            inline std::vector<delay_t>::const_iterator begin() const{
-                return Schedules::begin_by_id(id);
+            //Return index of starting schedule delimiter of schedule
+            inline uint16_t begin() const{
+                return Schedules::first_element(id);
             }
 
-            //Return const iterator pointing directly after end of schedule
-            inline std::vector<delay_t>::const_iterator end() const{
-                return Schedules::end_by_id(id);
+            //Return index directly after end of schedule
+            inline uint16_t end() const{
+                return Schedules::end_element(id);
             }
 
             //Return as protobuf defined Schedule
@@ -302,71 +485,20 @@ namespace iris{
             }
 
             typedef void (draw_callback_t)(size_t cue_id, uint32_t time, uint8_t draw_disabled_channels);
+            //Draw the cues of all periods that are on at time, later periods on top of earlier ones
             void draw(draw_callback_t* draw_cue, uint32_t time) const{
-                auto iter = this->begin();
-                auto end_iter = this->end();
-
-                size_t current_cue_id = iter->cue_id();
-                uint32_t current_delay = 0;
-                bool currently_on = true;
-                bool relevant_delay_found = false;
-
                 //If schedule duration is specified, the effect is looped
-                uint32_t schedule_duration = this->duration();
-                if (schedule_duration == INVALID_DELAY){
-                    //Jump over Schedule delimiter
-                    iter += 1;
-                } else {
-                    //Loop the
-                    if (schedule_duration != 0){
-                        time = time % schedule_duration;
-                    }
-                    //Jump over Schedule delimiter and duration
-                    iter += 2;
+                uint32_t schedule_duration = duration();
+                if (schedule_duration != INVALID_DELAY && schedule_duration != 0){
+                    time = time % schedule_duration;
                 }
 
-                while (true){
-                    //Prepare for parsing next period's delays
-                    if (iter->is_period_delimiter()){
-                        if (currently_on){
-                            (*draw_cue)(current_cue_id, time, false);
-                        }
-
-                        current_cue_id = iter->cue_id();
-                        current_delay = 0;
-                        currently_on = true;
-                        relevant_delay_found = false;
-                    }
-                    //Draw and end loop if end of schedule is reached
-                    else if (iter >= end_iter){
-                        if (currently_on){
-                            (*draw_cue)(current_cue_id, time, false);
-                        }
-
-                        break;
+                auto end = Schedules::periods_end(id);
+                for (auto period = Schedules::periods_begin(id); period != end; ++period){
+                    if (Schedules::is_on(*period, time)){
+                        (*draw_cue)(period->cue_id, time, false);
                     }
-                    //Seek the next delimiter
-                    else if (relevant_delay_found){
-                        continue;
-                    }
-                    //Found a delay
-                    else {
-                        current_delay += iter->delay();
-
-                        //Found the relevant delay, now we know
-                        //whether cue is on or off at this point in time
-                        if (current_delay > time){
-                            relevant_delay_found = true;
-                        }
-                        else{
-                            //toggle state of cue
-                            currently_on = !currently_on;
-                        }
-                    }
-
-                    //Increment iterator
-                    ++iter;
-                };
+                }
             }
     };
 }
@@ -0,0 +1,109 @@
+//Text output via the serial connection. Separate from communication.h,
+//so storage.h can report errors without depending on the protocol
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <Arduino.h>
+
+namespace freilite{
+namespace iris{
+namespace communication{
+    // Size of the buffer for text sent by printf
+    #ifndef IRIS_TX_BUFFER_SIZE
+    #define IRIS_TX_BUFFER_SIZE 64
+    #endif
+
+    // Everything sent to the host starts with one of these markers, as iris.proto
+    // describes it. Text starts with TEXT_MARKER and runs until the next marker,
+    // so it never contains either of them. Messages start with MESSAGE_MARKER,
+    // followed by their length as a varint and the encoded MessageData, see
+    // communication::send_message. Without the marker, a message of length 4
+    // would look like text
+    const char TEXT_MARKER = '\x04';
+    const char MESSAGE_MARKER = '\x00';
+
+    // Number of messages that didn't fit into the buffer and were cut short
+    uint16_t truncated_messages = 0;
+
+    namespace {
+        // Text waiting to be sent, sent from the front by flush()
+        // One more byte for the null character written by vsnprintf_P
+        char tx_buffer[IRIS_TX_BUFFER_SIZE + 1];
+        uint16_t tx_length = 0;
+
+        // Remove count bytes from the front of tx_buffer
+        void tx_consume(uint16_t count){
+            tx_length -= count;
+            memmove(tx_buffer, tx_buffer + count, tx_length);
+        }
+    }
+
+    // Send as much text queued by printf as the serial connection
+    // accepts without blocking. Should be called regularly
+    void flush(){
+        if(tx_length == 0) return;
+        int space = SerialUSB.availableForWrite();
+        if(space <= 0) return;
+
+        uint16_t count = static_cast<uint16_t>(space) < tx_length ? space : tx_length;
+        SerialUSB.write(reinterpret_cast<const uint8_t*>(tx_buffer), count);
+        tx_consume(count);
+    }
+
+    // Send all text queued by printf, blocking if necessary.
+    // Needs to be called before writing to the serial connection directly
+    void flush_all(){
+        if(tx_length == 0) return;
+        SerialUSB.write(reinterpret_cast<const uint8_t*>(tx_buffer), tx_length);
+        tx_consume(tx_length);
+    }
+
+    // Print just like std::printf but from a string stored in program
+    // memory and with leading TEXT_MARKER (EOT), see above
+    // Should always be used instead of std::printf
+    // Never blocks and never allocates: the text is formatted directly
+    // into tx_buffer and sent by flush(). If the buffer is full, the
+    // message is cut short and counted in truncated_messages
+    int printf(const __FlashStringHelper* format, ... ){
+        // Convert back from pseudo-class to pointer to program memory
+        const char* flash_string_pgm_ptr = reinterpret_cast<const char*>(format);
+
+        // Make room for the message if possible
+        flush();
+        if(tx_length >= IRIS_TX_BUFFER_SIZE){
+            ++truncated_messages;
+            return 0;
+        }
+
+        // Write leading EOT to buffer
+        tx_buffer[tx_length++] = TEXT_MARKER;
+
+        va_list arglist;
+        va_start(arglist, format);
+        int num_written = vsnprintf_P(tx_buffer + tx_length,
+                                      IRIS_TX_BUFFER_SIZE + 1 - tx_length,
+                                      flash_string_pgm_ptr, arglist);
+        va_end(arglist);
+        if(num_written < 0){
+            --tx_length;
+            return num_written;
+        }
+
+        uint16_t space = IRIS_TX_BUFFER_SIZE - tx_length;
+        if(static_cast<uint16_t>(num_written) > space){
+            num_written = space;
+            ++truncated_messages;
+        }
+        // Markers would end the text early
+        for(char* character = tx_buffer + tx_length; character < tx_buffer + tx_length + num_written; ++character){
+            if(*character == TEXT_MARKER || *character == MESSAGE_MARKER) *character = '?';
+        }
+        tx_length += num_written;
+
+        flush();
+        return num_written + 1;
+    }
+}
+}
+}
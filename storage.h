@@ -10,7 +10,7 @@
 
 #include "cue.h"
 #include "schedule.h"
-#include "communication.h"
+#include "serial_text.h"
 
 namespace freilite{
 namespace iris{
@@ -20,104 +20,687 @@ namespace storage{
         return Cues::size_in_bytes() + Schedules::size_in_bytes();
     }
 
+    //Layout of the EEPROM, all values are stored little-endian:
+    //
+    //  HEADER_SLOTS headers, STORED_HEADER_SIZE bytes each:
+    //      magic           2 bytes, FORMAT_MAGIC
+    //      version         1 byte, FORMAT_VERSION
+    //      generation      2 bytes
+    //      bank            1 byte, where the data is stored
+    //      cue count       2 bytes
+    //      element count   2 bytes, number of schedule elements
+    //      crc             2 bytes, CRC-16/CCITT over version, bank, counts and all data
+    //  data of the bank
+    //
+    //The data is stored in one of three banks: the first or second half
+    //of the space after the header slots, or all of it (WHOLE_BANK).
+    //In each bank, cues are stored at the beginning, each STORED_CUE_SIZE bytes
+    //(see Cue::encode()), and schedule elements, 2 bytes each, from the end backwards.
+    //That way, appending cues or schedule elements doesn't move anything that was stored already
+    //
+    //commit_to_eeprom() writes to the half that isn't in use and switches
+    //to it by writing the header, so the previous configuration stays intact
+    //until the new one is complete
+    //
+    //Images in PROGMEM, see mount_progmem(), consist of a single header
+    //followed by all cues and all schedule elements in order
+    const uint16_t FORMAT_MAGIC = 0x4972; //"rI"
+    //Increment whenever the layout changes
+    const uint8_t FORMAT_VERSION = 3;
+
+    const uint8_t STORED_HEADER_SIZE = 12;
+    const uint8_t STORED_CUE_SIZE = Cue::STORED_SIZE;
+    const uint8_t STORED_SCHEDULE_ELEMENT_SIZE = 2;
+
+    //The header is written to the next of these slots each time it changes,
+    //which spreads its writes over the slots
+    const uint8_t HEADER_SLOTS = 4;
+    const uint16_t DATA_BEGIN = HEADER_SLOTS * STORED_HEADER_SIZE;
+
+    //Banks 0 and 1 are the two halves of the data, see above
+    const uint8_t WHOLE_BANK = 2;
+
     //Additional info stored in EEPROM
     struct header_t{
+        //Incremented each time a header is written, the valid header
+        //is the one with the latest generation
+        uint16_t generation;
+        uint8_t bank;
         //This value is important to differentiate between byte data of cues and schedules
-        size_t number_of_cues;
-        size_t number_of_schedule_elements;
+        uint16_t number_of_cues;
+        uint16_t number_of_schedule_elements;
+        uint16_t crc;
     };
 
+    //Calculate size of cues and schedules when stored
+    uint32_t stored_size(uint16_t number_of_cues, uint16_t number_of_schedule_elements){
+        return uint32_t(number_of_cues) * STORED_CUE_SIZE + uint32_t(number_of_schedule_elements) * STORED_SCHEDULE_ELEMENT_SIZE;
+    }
 
-    //Write all cues and schedules as binary data starting at an iterator
-    //If maximum_size is specified, writing will only take place if the data fits
-    template<typename iteratorT>
-    void store_all(iteratorT begin, size_t maximum_size = 0){
-        size_t total_size = size_in_bytes() + sizeof(header_t);
-        if(maximum_size && total_size > maximum_size){
-            communication::printf(F("ERROR: Can't write %u bytes to EEPROM, it's only %u bytes long."), total_size, EEPROM.length());
-            return;
+    //Statistics of the last commit, see commit_step()
+    uint16_t bytes_compared = 0;
+    uint16_t bytes_written = 0;
+
+    namespace {
+        using namespace little_endian;
+
+        //Slot and content of the valid header, found by load or written by store
+        bool header_found = false;
+        uint8_t current_slot = HEADER_SLOTS - 1;
+        header_t current_header = {};
+
+        //Overflow-safe comparison of two generations
+        inline bool is_newer(uint16_t generation, uint16_t than){
+            return static_cast<int16_t>(generation - than) > 0;
         }
 
-        header_t header = { Cues::count(), Schedules::count() };
+        //CRC-16/CCITT, polynomial 0x1021
+        uint16_t crc16_update(uint16_t crc, uint8_t byte){
+            crc ^= uint16_t(byte) << 8;
+            for(uint8_t bit = 0; bit < 8; ++bit){
+                crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+            return crc;
+        }
 
-        //Iterator for the whole range
-        iteratorT store_iter = begin;
+        uint16_t crc16_update(uint16_t crc, const uint8_t* bytes, uint8_t length){
+            for(uint8_t i = 0; i < length; ++i){
+                crc = crc16_update(crc, bytes[i]);
+            }
+            return crc;
+        }
 
-        //Write header to range
-        const uint8_t* header_byte_iter = static_cast<const uint8_t*>(static_cast<void*>(&header));
+        //CRC of everything described by header, except the data itself
+        uint16_t crc16_begin(uint8_t bank, uint16_t number_of_cues, uint16_t number_of_schedule_elements){
+            uint8_t bytes[6] = {
+                FORMAT_VERSION,
+                bank,
+                uint8_t(number_of_cues), uint8_t(number_of_cues >> 8),
+                uint8_t(number_of_schedule_elements), uint8_t(number_of_schedule_elements >> 8)
+            };
+            return crc16_update(0xFFFF, bytes, sizeof(bytes));
+        }
 
-        for(int store_byte = 0; store_byte < sizeof(header); ++store_byte, ++store_iter, ++header_byte_iter){
-            *store_iter = *header_byte_iter;
+        void encode_header(const header_t& header, uint8_t* bytes){
+            put16(bytes, FORMAT_MAGIC);
+            *bytes++ = FORMAT_VERSION;
+            put16(bytes, header.generation);
+            *bytes++ = header.bank;
+            put16(bytes, header.number_of_cues);
+            put16(bytes, header.number_of_schedule_elements);
+            put16(bytes, header.crc);
         }
 
-        //Write cues to range
-        const uint8_t* cues_byte_iter = static_cast<const uint8_t*>(static_cast<const void*>(&*Cues::begin()));
+        //Return false if bytes don't hold a header of this version
+        bool decode_header(const uint8_t* bytes, header_t& header){
+            if(get16(bytes) != FORMAT_MAGIC) return false;
+            if(*bytes++ != FORMAT_VERSION) return false;
+            header.generation = get16(bytes);
+            header.bank = *bytes++;
+            if(header.bank > WHOLE_BANK) return false;
+            header.number_of_cues = get16(bytes);
+            header.number_of_schedule_elements = get16(bytes);
+            header.crc = get16(bytes);
+            return true;
+        }
 
-        for(int store_byte = 0; store_byte < sizeof(Cue) * Cues::count(); ++store_byte, ++store_iter, ++cues_byte_iter){
-            *store_iter = *cues_byte_iter;
+        //Return first address of bank
+        inline uint16_t bank_begin(uint8_t bank){
+            return bank == 1 ? DATA_BEGIN + (EEPROM.length() - DATA_BEGIN) / 2 : DATA_BEGIN;
         }
 
-        //Write schedules to range
-        const uint8_t* schedules_byte_iter = static_cast<const uint8_t*>(static_cast<const void*>(&*Schedules::begin_by_id(0)));
+        //Return address directly after the end of bank
+        inline uint16_t bank_end(uint8_t bank){
+            return bank == 0 ? bank_begin(1) : EEPROM.length();
+        }
 
-        for(int store_byte = 0; store_byte < sizeof(delay_t) * Schedules::count(); ++store_byte, ++store_iter, ++schedules_byte_iter){
-            *store_iter  = *schedules_byte_iter;
+        //Return address of a cue stored in bank
+        inline uint16_t cue_address(uint8_t bank, uint16_t index){
+            return bank_begin(bank) + index * STORED_CUE_SIZE;
         }
-    }
 
-    //Stores all cues and schedules to eeprom
-    void store_all_in_eeprom(){
-        store_all(EEPROM.begin(), EEPROM.length());
+        //Return address of a schedule element stored in bank
+        inline uint16_t schedule_element_address(uint8_t bank, uint16_t index){
+            return bank_end(bank) - (index + 1) * STORED_SCHEDULE_ELEMENT_SIZE;
+        }
+
+        //Return true if the header describes data that fits into its bank
+        inline bool fits(const header_t& header){
+            return stored_size(header.number_of_cues, header.number_of_schedule_elements) <=
+                   uint16_t(bank_end(header.bank) - bank_begin(header.bank));
+        }
+
+        //Find the valid header in EEPROM. Returns false if no header was written yet
+        bool find_header(){
+            header_found = false;
+            current_slot = HEADER_SLOTS - 1;
+
+            for(uint8_t slot = 0; slot < HEADER_SLOTS; ++slot){
+                uint8_t bytes[STORED_HEADER_SIZE];
+                header_t header;
+                media::eeprom.read(slot * STORED_HEADER_SIZE, bytes, sizeof(bytes));
+                if(!decode_header(bytes, header)) continue;
+
+                if(!header_found || is_newer(header.generation, current_header.generation)){
+                    current_slot = slot;
+                    current_header = header;
+                    header_found = true;
+                }
+            }
+            return header_found;
+        }
+
+        //Return true if the CRC of the data stored on medium matches header.
+        //Schedule element i is stored at elements_address + i * elements_step
+        bool verify(const medium_t& medium, const header_t& header, uint16_t cues_address,
+                    uint16_t elements_address, int8_t elements_step){
+            uint16_t crc = crc16_begin(header.bank, header.number_of_cues, header.number_of_schedule_elements);
+            for(uint16_t i = 0; i < header.number_of_cues; ++i){
+                uint8_t bytes[STORED_CUE_SIZE];
+                medium.read(cues_address + i * STORED_CUE_SIZE, bytes, sizeof(bytes));
+                crc = crc16_update(crc, bytes, sizeof(bytes));
+            }
+            for(uint16_t i = 0; i < header.number_of_schedule_elements; ++i){
+                uint8_t bytes[STORED_SCHEDULE_ELEMENT_SIZE];
+                medium.read(elements_address + int16_t(i) * elements_step, bytes, sizeof(bytes));
+                crc = crc16_update(crc, bytes, sizeof(bytes));
+            }
+            return crc == header.crc;
+        }
+
+        //Return valid header in EEPROM, or false if there is none or the data is corrupted
+        bool find_valid_header(){
+            if(!find_header()) return false;
+
+            const header_t& header = current_header;
+            if(!fits(header) ||
+               !verify(media::eeprom, header, cue_address(header.bank, 0),
+                       schedule_element_address(header.bank, 0), -STORED_SCHEDULE_ELEMENT_SIZE)){
+                communication::printf(F("ERROR: Configuration in EEPROM is corrupted.\n"));
+                return false;
+            }
+            return true;
+        }
     }
 
-    //Load all cues and schedules from binary data between two input-iterators
-    template<typename iteratorT>
-    void load_all(iteratorT begin, iteratorT end){
-        Cues::clear();
-        Schedules::clear();
+    //Returns cue with ID cue_id to be stored, see commit_to_eeprom()
+    typedef const Cue& (cue_source_t)(size_t cue_id);
+    //Returns schedule element with index to be stored, see begin_store()
+    typedef delay_t (element_source_t)(uint16_t index);
 
-        //Iterator for the whole range
-        iteratorT store_iter = begin;
+    namespace {
+        //CRC of the configuration as it would be stored in bank
+        uint16_t configuration_crc(uint8_t bank, cue_source_t* cue_source,
+                                   uint16_t number_of_cues, uint16_t number_of_schedule_elements){
+            uint16_t crc = crc16_begin(bank, number_of_cues, number_of_schedule_elements);
+            for(uint16_t i = 0; i < number_of_cues; ++i){
+                uint8_t bytes[STORED_CUE_SIZE];
+                (*cue_source)(i).encode(bytes);
+                crc = crc16_update(crc, bytes, sizeof(bytes));
+            }
+            for(uint16_t i = 0; i < number_of_schedule_elements; ++i){
+                uint16_t raw = Schedules::element(i).raw();
+                uint8_t bytes[STORED_SCHEDULE_ELEMENT_SIZE] = { uint8_t(raw), uint8_t(raw >> 8) };
+                crc = crc16_update(crc, bytes, sizeof(bytes));
+            }
+            return crc;
+        }
 
-        //Read header from range
-        header_t header;
-        uint8_t* header_byte_iter = static_cast<uint8_t*>(static_cast<void*>(&header));
+        //Bytes written by write_step(), a cue, schedule element or header
+        uint8_t pending_bytes[STORED_CUE_SIZE];
+        static_assert(STORED_HEADER_SIZE <= STORED_CUE_SIZE, "Headers are written from pending_bytes");
+        uint16_t pending_address = 0;
+        uint8_t pending_length = 0;
+        //Next byte of pending_bytes to compare
+        uint8_t pending_offset = 0;
 
-        for(int store_byte = 0; store_byte < sizeof(header); ++store_byte, ++store_iter, ++header_byte_iter){
-            if(store_iter >= end) return;
-            *header_byte_iter = *store_iter;
+        //Start writing the first length bytes of pending_bytes to address
+        void begin_write(uint16_t address, uint8_t length){
+            pending_address = address;
+            pending_length = length;
+            pending_offset = 0;
         }
 
-        //Load cues from range
-        for(int store_byte = 0; store_byte < sizeof(Cue) * header.number_of_cues;){
-            //Build full cue to allow pushing it properly
-            Cue cue;
-            for(int cue_byte = 0; cue_byte < sizeof(Cue); ++store_byte, ++cue_byte, ++store_iter){
-                if(store_iter >= end) return;
-                static_cast<uint8_t*>(static_cast<void*>(&cue))[cue_byte] = *store_iter;
+        //Progress of the commit started by begin_store(), see commit_step()
+        enum class commit_stage_t : uint8_t{ idle, cues, elements, header, finish };
+        commit_stage_t commit_stage = commit_stage_t::idle;
+        cue_source_t* commit_cue_source = &Cues::get;
+        element_source_t* commit_element_source = &Schedules::element;
+        //Header written at the end, its crc is updated as the data is written
+        header_t commit_header = {};
+        //Next cue or schedule element to write
+        uint16_t commit_item = 0;
+        //Set while the commit only copies the configuration in use, see begin_mirror()
+        bool mirroring_commit = false;
+
+        //Start writing number_of_cues cues, taken from cue_source, and number_of_schedule_elements
+        //schedule elements, taken from element_source, to bank. Returns false if they don't fit
+        bool begin_store(uint8_t bank, cue_source_t* cue_source, uint16_t number_of_cues,
+                         element_source_t* element_source, uint16_t number_of_schedule_elements){
+            bytes_compared = 0;
+            bytes_written = 0;
+
+            header_t header = {
+                static_cast<uint16_t>(header_found ? current_header.generation + 1 : 0),
+                bank,
+                number_of_cues,
+                number_of_schedule_elements,
+                crc16_begin(bank, number_of_cues, number_of_schedule_elements)
+            };
+            if(!fits(header)){
+                uint32_t total_size = DATA_BEGIN + stored_size(number_of_cues, number_of_schedule_elements);
+                communication::printf(F("ERROR: Can't write %lu bytes to EEPROM, it's only %u bytes long."), (unsigned long)total_size, EEPROM.length());
+                return false;
             }
 
-            Cues::push(cue);
+            commit_header = header;
+            commit_cue_source = cue_source;
+            commit_element_source = element_source;
+            commit_item = 0;
+            commit_stage = commit_stage_t::cues;
+            mirroring_commit = false;
+            return true;
         }
+    }
 
-        //Write schedules to range
-        for(int store_byte = 0; store_byte < sizeof(delay_t) * header.number_of_schedule_elements;){
-            //Build full schedule element to allow pushing it properly
-            delay_t schedule_element;
-            for(int schedule_byte = 0; schedule_byte < sizeof(delay_t); ++store_byte, ++schedule_byte, ++store_iter){
-                if(store_iter >= end) return;
-                static_cast<uint8_t*>(static_cast<void*>(&schedule_element))[schedule_byte] = *store_iter;
+    //Continue writing the bytes of a cue staged by stage_cue() or of a commit: compare them
+    //to the EEPROM until one differs, and start writing that one. Never waits for the EEPROM,
+    //which writes a byte in about 3.3 ms in the background. Returns true while bytes are left
+    bool write_step(){
+        while(pending_offset < pending_length){
+            if(!eeprom_is_ready()) return true;
+            uint16_t address = pending_address + pending_offset;
+            uint8_t byte = pending_bytes[pending_offset++];
+            ++bytes_compared;
+            if(EEPROM.read(address) != byte){
+                EEPROM.write(address, byte);
+                ++bytes_written;
+                break;
             }
+        }
+        return pending_offset < pending_length;
+    }
+
+    //Continue the commit started by begin_commit() or begin_staged_commit(), at most
+    //one cue, schedule element or header at a time. Returns true until it is done.
+    //A header describing the previous data of the bank may still be valid while
+    //the data is written, but the header written at the end replaces it
+    bool commit_step(){
+        if(write_step()) return true;
+        //Cues and schedules may be read from the EEPROM, which would wait for it
+        if(commit_stage != commit_stage_t::idle && !eeprom_is_ready()) return true;
+
+        header_t& header = commit_header;
+        switch(commit_stage){
+            case commit_stage_t::idle:
+                return false;
+
+            case commit_stage_t::cues:
+                if(commit_item < header.number_of_cues){
+                    (*commit_cue_source)(commit_item).encode(pending_bytes);
+                    header.crc = crc16_update(header.crc, pending_bytes, STORED_CUE_SIZE);
+                    begin_write(cue_address(header.bank, commit_item++), STORED_CUE_SIZE);
+                    break;
+                }
+                commit_stage = commit_stage_t::elements;
+                commit_item = 0;
+                //fall through
+            case commit_stage_t::elements:
+                if(commit_item < header.number_of_schedule_elements){
+                    uint16_t raw = (*commit_element_source)(commit_item).raw();
+                    pending_bytes[0] = raw;
+                    pending_bytes[1] = raw >> 8;
+                    header.crc = crc16_update(header.crc, pending_bytes, STORED_SCHEDULE_ELEMENT_SIZE);
+                    begin_write(schedule_element_address(header.bank, commit_item++), STORED_SCHEDULE_ELEMENT_SIZE);
+                    break;
+                }
+                commit_stage = commit_stage_t::header;
+                //fall through
+            case commit_stage_t::header:
+                //A copy of the configuration in use must not replace it
+                if(mirroring_commit){
+                    mirroring_commit = false;
+                    commit_stage = commit_stage_t::idle;
+                    return false;
+                }
+                if(header_found &&
+                   current_header.bank == header.bank &&
+                   current_header.number_of_cues == header.number_of_cues &&
+                   current_header.number_of_schedule_elements == header.number_of_schedule_elements &&
+                   current_header.crc == header.crc){
+                    commit_stage = commit_stage_t::idle;
+                    return false;
+                }
+                //Write header to the slot after the current one
+                encode_header(header, pending_bytes);
+                begin_write((current_slot + 1) % HEADER_SLOTS * STORED_HEADER_SIZE, STORED_HEADER_SIZE);
+                commit_stage = commit_stage_t::finish;
+                break;
+
+            case commit_stage_t::finish:
+                header_found = true;
+                current_slot = (current_slot + 1) % HEADER_SLOTS;
+                current_header = header;
+                commit_stage = commit_stage_t::idle;
+                return false;
+        }
+        write_step();
+        return true;
+    }
+
+    namespace {
+        //Carry out the commit started by begin_store() at once
+        void finish_commit(){
+            while(commit_step()) eeprom_busy_wait();
+        }
+    }
 
-            Schedules::push_element(schedule_element);
+    //Stores all cues and schedules to eeprom. Only bytes that changed are written,
+    //the header only if anything changed. The data is overwritten in place,
+    //if this is interrupted the stored configuration is lost
+    void store_all_in_eeprom(){
+        //Stay in the current bank if the configuration fits
+        header_t header = { 0, header_found ? current_header.bank : uint8_t(0),
+                            uint16_t(Cues::count()), uint16_t(Schedules::element_count()), 0 };
+        if(!fits(header)) header.bank = WHOLE_BANK;
+        if(begin_store(header.bank, &Cues::get, Cues::count(), &Schedules::element, Schedules::element_count())){
+            finish_commit();
         }
     }
 
-        //Loads all cues and scheduels stored in EEPROM.
+    //Start storing all cues and schedules to eeprom, taking cues from cue_source, so single
+    //cues can be replaced without loading all of them into RAM. The commit is carried out
+    //by commit_step(), so it doesn't hold up the main loop; cues and schedules must not
+    //change until it is done.
+    //They are written to the half of the EEPROM not in use, and only then the header
+    //switches to it. If this is interrupted, the previous configuration is still valid.
+    //Configurations larger than half the EEPROM are stored in place like store_all_in_eeprom().
+    //Returns false if the configuration is too large for the EEPROM
+    bool begin_commit(cue_source_t* cue_source = &Cues::get){
+        uint16_t number_of_cues = Cues::count();
+        uint16_t number_of_schedule_elements = Schedules::element_count();
+        if(header_found && current_header.bank != WHOLE_BANK &&
+           current_header.number_of_cues == number_of_cues &&
+           current_header.number_of_schedule_elements == number_of_schedule_elements &&
+           current_header.crc == configuration_crc(current_header.bank, cue_source, number_of_cues, number_of_schedule_elements)){
+            //Nothing changed
+            bytes_compared = 0;
+            bytes_written = 0;
+            commit_stage = commit_stage_t::idle;
+            mirroring_commit = false;
+            return true;
+        }
+
+        header_t header = { 0, uint8_t(header_found && current_header.bank == 0 ? 1 : 0),
+                            number_of_cues, number_of_schedule_elements, 0 };
+        if(!fits(header)) header.bank = WHOLE_BANK;
+        return begin_store(header.bank, cue_source, number_of_cues, &Schedules::element, number_of_schedule_elements);
+    }
+
+    //Like begin_commit(), but waits until the commit is done
+    bool commit_to_eeprom(cue_source_t* cue_source = &Cues::get){
+        if(!begin_commit(cue_source)) return false;
+        finish_commit();
+        return true;
+    }
+
+    //A configuration that is uploaded can be staged in EEPROM as it arrives, instead of
+    //holding it in RAM until it is committed. It is staged in the half of the EEPROM not in use,
+    //so it has to fit into it, and the configuration in use can still be shown meanwhile.
+    //A configuration stored in place is overwritten by staging, see staging_in_place().
+    //Return bank the configuration is staged in
+    inline uint8_t staging_bank(){
+        return header_found && current_header.bank == 0 ? 1 : 0;
+    }
+
+    //Return true if staging overwrites the configuration in use, so it can't be shown meanwhile
+    inline bool staging_in_place(){
+        return header_found && current_header.bank == WHOLE_BANK;
+    }
+
+    namespace {
+        //Schedule elements passed to stage_element() that are still to be written by stage_step(),
+        //the first one is element queued_index. Decoding a schedule field stages at most three,
+        //see Schedules::begin_decoding()
+        const uint8_t ELEMENT_QUEUE_SIZE = 3;
+        uint16_t element_queue[ELEMENT_QUEUE_SIZE];
+        uint8_t queued_elements = 0;
+        uint16_t queued_index = 0;
+        //Delimiters staged so far, they need to fit into the period table once mounted
+        uint16_t staged_periods = 0;
+        uint8_t staged_schedules = 0;
+
+        //Cue returned by peeked_cue() and staged_cue()
+        Cue source_cue;
+    }
+
+    //Start staging a configuration, dropping a commit in progress and anything staged before
+    void begin_staging(){
+        begin_write(0, 0);
+        commit_stage = commit_stage_t::idle;
+        mirroring_commit = false;
+        queued_elements = 0;
+        staged_periods = 0;
+        staged_schedules = 0;
+    }
+
+    //Start writing cue to the staging bank as cue cue_id, carried out by stage_step().
+    //Returns false if it doesn't fit into the staging bank
+    bool stage_cue(uint16_t cue_id, const Cue& cue){
+        uint8_t bank = staging_bank();
+        if(stored_size(cue_id + 1, 0) > uint16_t(bank_end(bank) - bank_begin(bank))) return false;
+        cue.encode(pending_bytes);
+        begin_write(cue_address(bank, cue_id), STORED_CUE_SIZE);
+        write_step();
+        return true;
+    }
+
+    //Stage element as schedule element index of a configuration of number_of_cues cues,
+    //written by stage_step(). Up to ELEMENT_QUEUE_SIZE elements can be staged until it is done.
+    //Returns false if there is no room for it in the staging bank or the period table
+    bool stage_element(uint16_t number_of_cues, uint16_t index, delay_t element){
+        uint8_t bank = staging_bank();
+        if(queued_elements == ELEMENT_QUEUE_SIZE) return false;
+        if(stored_size(number_of_cues, index + 1) > uint16_t(bank_end(bank) - bank_begin(bank))) return false;
+        if(element.is_delimiter() && ++staged_periods > IRIS_MAX_PERIODS) return false;
+        if(element.is_schedule_delimiter() && ++staged_schedules > IRIS_MAX_SCHEDULES) return false;
+
+        if(!queued_elements) queued_index = index;
+        element_queue[queued_elements++] = element.raw();
+        return true;
+    }
+
+    //Continue writing the staged cue or schedule elements like write_step(), never waits for the EEPROM.
+    //Returns true while bytes are left
+    bool stage_step(){
+        if(write_step()) return true;
+        if(!queued_elements) return false;
+
+        uint16_t raw = element_queue[0];
+        --queued_elements;
+        for(uint8_t i = 0; i < queued_elements; ++i) element_queue[i] = element_queue[i + 1];
+        pending_bytes[0] = raw;
+        pending_bytes[1] = raw >> 8;
+        begin_write(schedule_element_address(staging_bank(), queued_index++), STORED_SCHEDULE_ELEMENT_SIZE);
+        write_step();
+        return true;
+    }
+
+    //Returns cue cue_id like Cues::get(), but leaves the cached cues to the ones drawn.
+    //Valid until it or staged_cue() is called again
+    const Cue& peeked_cue(size_t cue_id){
+        source_cue = Cues::peek(cue_id);
+        return source_cue;
+    }
+
+    namespace {
+        //Return cue cue_id stored in bank, valid until source_cue is changed again
+        const Cue& stored_cue(uint8_t bank, size_t cue_id){
+            uint8_t bytes[STORED_CUE_SIZE];
+            media::eeprom.read(cue_address(bank, cue_id), bytes, sizeof(bytes));
+            source_cue = Cue::decode(bytes);
+            return source_cue;
+        }
+
+        //Return schedule element with index stored in bank
+        delay_t stored_element(uint8_t bank, uint16_t index){
+            uint8_t bytes[STORED_SCHEDULE_ELEMENT_SIZE];
+            media::eeprom.read(schedule_element_address(bank, index), bytes, sizeof(bytes));
+            return delay_t(uint16_t(bytes[0] | uint16_t(bytes[1]) << 8));
+        }
+
+        const Cue& current_cue(size_t cue_id){
+            return stored_cue(current_header.bank, cue_id);
+        }
+
+        delay_t current_element(uint16_t index){
+            return stored_element(current_header.bank, index);
+        }
+    }
+
+    //Return staged cue cue_id, see stage_cue(). Valid until it or peeked_cue() is called again
+    const Cue& staged_cue(size_t cue_id){
+        return stored_cue(staging_bank(), cue_id);
+    }
+
+    //Return staged schedule element with index, see stage_element()
+    delay_t staged_element(uint16_t index){
+        return stored_element(staging_bank(), index);
+    }
+
+    //Start committing the first number_of_cues staged cues and number_of_schedule_elements staged
+    //schedule elements, which all have to be written already, see begin_commit(). They are read back
+    //for the header, which is the only thing left to write. Returns false if they don't fit
+    bool begin_staged_commit(uint16_t number_of_cues, uint16_t number_of_schedule_elements){
+        return begin_store(staging_bank(), &staged_cue, number_of_cues, &staged_element, number_of_schedule_elements);
+    }
+
+    //Start copying the configuration in use to the half of the EEPROM not in use, carried out by
+    //commit_step() like a commit but without writing a header. As only bytes that changed are written,
+    //a later commit that replaces a few cues then only writes those and the header.
+    //Any commit or staging cancels the copy. Does nothing for configurations stored in place
+    //or too large for the other half
+    void begin_mirror(){
+        if(!header_found || current_header.bank == WHOLE_BANK) return;
+        header_t header = { 0, staging_bank(), current_header.number_of_cues, current_header.number_of_schedule_elements, 0 };
+        if(!fits(header)) return;
+        begin_store(header.bank, &current_cue, header.number_of_cues, &current_element, header.number_of_schedule_elements);
+        mirroring_commit = true;
+    }
+
+    //Return true while the copy started by begin_mirror() is in progress
+    inline bool mirroring(){
+        return mirroring_commit;
+    }
+
+    //Loads all cues and scheduels stored in EEPROM. The data is verified before
+    //anything is loaded, nothing is loaded if it is corrupted or doesn't fit into RAM.
     //WARNING! This will automatically clear cues and schedules!
     void load_all_from_eeprom(){
-        load_all(EEPROM.begin(), EEPROM.end());
+        Cues::clear();
+        Schedules::clear();
+
+        if(!find_valid_header()) return;
+
+        const header_t& header = current_header;
+        if(header.number_of_cues > Cues::free_slots() ||
+           header.number_of_schedule_elements > Schedules::free_slots()){
+            communication::printf(F("ERROR: Configuration in EEPROM doesn't fit into RAM, mount it instead.\n"));
+            return;
+        }
+
+        for(uint16_t i = 0; i < header.number_of_cues; ++i){
+            uint8_t bytes[STORED_CUE_SIZE];
+            media::eeprom.read(cue_address(header.bank, i), bytes, sizeof(bytes));
+            Cues::push(Cue::decode(bytes));
+        }
+        for(uint16_t i = 0; i < header.number_of_schedule_elements; ++i){
+            uint8_t bytes[STORED_SCHEDULE_ELEMENT_SIZE];
+            media::eeprom.read(schedule_element_address(header.bank, i), bytes, sizeof(bytes));
+            if(!Schedules::push_element(delay_t(uint16_t(bytes[0] | uint16_t(bytes[1]) << 8)))){
+                Cues::clear();
+                Schedules::clear();
+                communication::printf(F("ERROR: Schedules in EEPROM have too many periods.\n"));
+                return;
+            }
+        }
+    }
+
+    //Use all cues and schedules stored in EEPROM without copying them to RAM,
+    //only the period table of the schedules is compiled. Returns false and leaves
+    //nothing loaded if there is no configuration, it is corrupted or its schedules
+    //have more periods than fit into the period table.
+    //Storing changes to EEPROM while it is mounted is fine, as long as
+    //cues and schedules are cleared before anything else is pushed.
+    //WARNING! This will automatically clear cues and schedules!
+    bool mount_eeprom(){
+        Cues::clear();
+        Schedules::clear();
+
+        if(!find_valid_header()) return false;
+
+        const header_t& header = current_header;
+        if(!Schedules::mount(media::eeprom, schedule_element_address(header.bank, 0), -STORED_SCHEDULE_ELEMENT_SIZE,
+                             header.number_of_schedule_elements)){
+            communication::printf(F("ERROR: Schedules in EEPROM have too many periods.\n"));
+            return false;
+        }
+        Cues::mount(media::eeprom, cue_address(header.bank, 0), header.number_of_cues);
+        return true;
+    }
+
+    //Use all cues and schedules of an image stored in PROGMEM without copying them to RAM,
+    //see create_image(). Returns false and leaves nothing loaded if the image is corrupted
+    //or its schedules have more periods than fit into the period table.
+    //WARNING! This will automatically clear cues and schedules!
+    bool mount_progmem(const uint8_t* image){
+        Cues::clear();
+        Schedules::clear();
+
+        medium_t medium = media::progmem(image);
+        uint8_t bytes[STORED_HEADER_SIZE];
+        header_t header;
+        medium.read(0, bytes, sizeof(bytes));
+        if(!decode_header(bytes, header)) return false;
+
+        uint16_t elements_address = STORED_HEADER_SIZE + header.number_of_cues * STORED_CUE_SIZE;
+        if(!verify(medium, header, STORED_HEADER_SIZE, elements_address, STORED_SCHEDULE_ELEMENT_SIZE)){
+            return false;
+        }
+
+        if(!Schedules::mount(medium, elements_address, STORED_SCHEDULE_ELEMENT_SIZE, header.number_of_schedule_elements)){
+            return false;
+        }
+        Cues::mount(medium, STORED_HEADER_SIZE, header.number_of_cues);
+        return true;
     }
+
+    //Write all cues and schedules as an image for mount_progmem() to image,
+    //e.g. to generate a built-in show library. Returns the size of the image,
+    //or 0 if it would be larger than maximum_size
+    size_t create_image(uint8_t* image, size_t maximum_size){
+        uint16_t number_of_cues = Cues::count();
+        uint16_t number_of_schedule_elements = Schedules::element_count();
+        uint32_t size = STORED_HEADER_SIZE + stored_size(number_of_cues, number_of_schedule_elements);
+        if(size > maximum_size) return 0;
+
+        uint8_t* bytes = image + STORED_HEADER_SIZE;
+        for(uint16_t i = 0; i < number_of_cues; ++i, bytes += STORED_CUE_SIZE){
+            Cues::get(i).encode(bytes);
+        }
+        for(uint16_t i = 0; i < number_of_schedule_elements; ++i){
+            put16(bytes, Schedules::element(i).raw());
+        }
+
+        uint16_t crc = crc16_begin(0, number_of_cues, number_of_schedule_elements);
+        for(uint8_t* byte = image + STORED_HEADER_SIZE; byte < image + size; ++byte){
+            crc = crc16_update(crc, *byte);
+        }
+
+        header_t header = { 0, 0, number_of_cues, number_of_schedule_elements, crc };
+        encode_header(header, image);
+        return size;
+    }
+}
 }
 }
-}
\ No newline at end of file